@@ -0,0 +1,335 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "intfile.h"
+#include "sort.h"
+
+/**
+ * Benchmark of the sorter phases. Numbers of several distributions
+ * are generated in memory and split into files. Then each repetition
+ * writes the files, reads them back, sorts each one and merges the
+ * results like the main program does. Every phase is timed
+ * separately, so a regression is visible in the phase it happened.
+ *
+ * $> make bench
+ * $> ./bench [-n count] [-f files] [-r repetitions] [-t text|raw|varint]
+ */
+
+enum bench_phase
+{
+	PHASE_WRITE,
+	PHASE_READ,
+	PHASE_SORT,
+	PHASE_MERGE,
+	PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	"write", "read", "sort", "merge",
+};
+
+enum bench_dist
+{
+	DIST_UNIFORM,
+	DIST_SORTED,
+	DIST_REVERSED,
+	DIST_FEW_UNIQUE,
+	DIST_ZIPF,
+	DIST_ORGAN_PIPE,
+	DIST_COUNT,
+};
+
+static const char *dist_names[DIST_COUNT] = {
+	"uniform", "sorted", "reversed", "few-unique", "zipf", "organ-pipe",
+};
+
+enum
+{
+	/** Distinct values in the few-unique distribution. */
+	FEW_UNIQUE_COUNT = 16,
+	/** Distinct values in the zipf distribution. */
+	ZIPF_RANKS = 10000,
+};
+
+struct bench_opts
+{
+	size_t count;
+	int files;
+	int reps;
+	enum intfile_format format;
+};
+
+static long long
+bench_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/** Xorshift64* - fast and good enough for test data. */
+static uint64_t
+bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Zipf with exponent 1 over ZIPF_RANKS values: rank i has weight
+ * 1 / i. The ranks are found by a binary search in the cumulative
+ * weights and then scattered over the int range.
+ */
+static void
+bench_gen_zipf(int *numbers, size_t count, uint64_t *seed)
+{
+	double *cdf = malloc(ZIPF_RANKS * sizeof(*cdf));
+	double sum = 0;
+	for (int i = 0; i < ZIPF_RANKS; ++i)
+	{
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		double u = (bench_rand(seed) >> 11) * (1.0 / (1ULL << 53)) * sum;
+		int lo = 0, hi = ZIPF_RANKS - 1;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		numbers[i] = (int)((uint32_t)lo * 2654435761U);
+	}
+	free(cdf);
+}
+
+static void
+bench_gen(int *numbers, size_t count, enum bench_dist dist)
+{
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	switch (dist)
+	{
+	case DIST_UNIFORM:
+		for (size_t i = 0; i < count; ++i)
+			numbers[i] = (int)bench_rand(&seed);
+		break;
+	case DIST_SORTED:
+		for (size_t i = 0; i < count; ++i)
+			numbers[i] = (int)i;
+		break;
+	case DIST_REVERSED:
+		for (size_t i = 0; i < count; ++i)
+			numbers[i] = (int)(count - i);
+		break;
+	case DIST_FEW_UNIQUE:
+		for (size_t i = 0; i < count; ++i)
+			numbers[i] = (int)(bench_rand(&seed) % FEW_UNIQUE_COUNT);
+		break;
+	case DIST_ZIPF:
+		bench_gen_zipf(numbers, count, &seed);
+		break;
+	case DIST_ORGAN_PIPE:
+		for (size_t i = 0; i < count; ++i)
+			numbers[i] = (int)(i < count / 2 ? i : count - i);
+		break;
+	default:
+		abort();
+	}
+}
+
+static int
+bench_cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+bench_print_stats(const char *dist, const char *phase, long long *samples,
+		  int count)
+{
+	qsort(samples, count, sizeof(*samples), bench_cmp_ll);
+	int p99 = (count * 99 + 99) / 100 - 1;
+	printf("%-12s %-6s %12.1f %12.1f %12.1f\n", dist, phase,
+	       samples[0] / 1000.0, samples[count / 2] / 1000.0,
+	       samples[p99] / 1000.0);
+}
+
+/** One repetition of all the phases. Times go to @a times. */
+static int
+bench_run_once(const int *numbers, const struct bench_opts *opts,
+	       char paths[][64], long long *times)
+{
+	size_t chunk = opts->count / opts->files;
+	int **arrays = calloc(opts->files, sizeof(*arrays));
+	size_t *sizes = calloc(opts->files, sizeof(*sizes));
+	int rc = -1;
+
+	long long start = bench_now_ns();
+	for (int i = 0; i < opts->files; ++i)
+	{
+		size_t size = i == opts->files - 1 ? opts->count - chunk * i : chunk;
+		FILE *f = fopen(paths[i], "w");
+		if (f == NULL)
+			goto out;
+		int write_rc = intfile_write(f, opts->format, numbers + chunk * i,
+					     size);
+		if (fclose(f) != 0 || write_rc != 0)
+			goto out;
+	}
+	times[PHASE_WRITE] = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (int i = 0; i < opts->files; ++i)
+	{
+		if (intfile_load(paths[i], &arrays[i], &sizes[i]) != 0)
+			goto out;
+	}
+	times[PHASE_READ] = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (int i = 0; i < opts->files; ++i)
+	{
+		if (mergesort(arrays[i], sizes[i], sizeof(int), int_gt_comparator) != 0)
+			goto out;
+	}
+	times[PHASE_SORT] = bench_now_ns() - start;
+
+	/* The same merge order as in main() of the sorter. */
+	start = bench_now_ns();
+	int *result = malloc(0);
+	size_t result_size = 0;
+	for (int i = 0; i < opts->files; ++i)
+	{
+		int *tmp = malloc((result_size + sizes[i]) * sizeof(int));
+		merge(result, arrays[i], result_size, sizes[i], sizeof(int),
+		      int_gt_comparator, tmp);
+		result_size += sizes[i];
+		free(result);
+		result = tmp;
+	}
+	times[PHASE_MERGE] = bench_now_ns() - start;
+
+	for (size_t i = 1; i < result_size; ++i)
+	{
+		if (result[i - 1] > result[i])
+		{
+			printf("Result is not sorted at %zu\n", i);
+			free(result);
+			goto out;
+		}
+	}
+	free(result);
+	rc = 0;
+out:
+	for (int i = 0; i < opts->files; ++i)
+		free(arrays[i]);
+	free(arrays);
+	free(sizes);
+	return rc;
+}
+
+static int
+bench_parse_opts(int argc, char **argv, struct bench_opts *opts)
+{
+	int c;
+	while ((c = getopt(argc, argv, "n:f:r:t:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			opts->count = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			opts->files = atoi(optarg);
+			break;
+		case 'r':
+			opts->reps = atoi(optarg);
+			break;
+		case 't':
+			if (intfile_format_from_str(optarg, &opts->format) != 0)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (opts->files <= 0 || opts->reps <= 0 ||
+	    opts->count < (size_t)opts->files)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts opts = {
+		.count = 1000000,
+		.files = 8,
+		.reps = 11,
+		.format = INTFILE_FORMAT_TEXT,
+	};
+	if (bench_parse_opts(argc, argv, &opts) != 0)
+	{
+		printf("Usage: %s [-n count] [-f files] [-r repetitions] "
+		       "[-t text|raw|varint]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* The sort yields, so it needs a scheduler even without coroutines. */
+	coro_sched_init();
+
+	char (*paths)[64] = malloc(opts.files * sizeof(*paths));
+	for (int i = 0; i < opts.files; ++i)
+	{
+		snprintf(paths[i], sizeof(paths[i]), "/tmp/sort_bench_%d_%d.tmp",
+			 (int)getpid(), i);
+	}
+	int *numbers = malloc(opts.count * sizeof(int));
+	long long *samples = malloc(PHASE_COUNT * opts.reps * sizeof(*samples));
+	int rc = 0;
+
+	printf("%zu numbers in %d files, %d repetitions, times in us\n",
+	       opts.count, opts.files, opts.reps);
+	printf("%-12s %-6s %12s %12s %12s\n", "distribution", "phase", "min",
+	       "median", "p99");
+	for (int d = 0; d < DIST_COUNT && rc == 0; ++d)
+	{
+		bench_gen(numbers, opts.count, d);
+		for (int r = 0; r < opts.reps; ++r)
+		{
+			long long times[PHASE_COUNT];
+			if (bench_run_once(numbers, &opts, paths, times) != 0)
+			{
+				printf("Repetition failed for %s\n", dist_names[d]);
+				rc = -1;
+				break;
+			}
+			for (int p = 0; p < PHASE_COUNT; ++p)
+				samples[p * opts.reps + r] = times[p];
+		}
+		for (int p = 0; p < PHASE_COUNT && rc == 0; ++p)
+		{
+			bench_print_stats(dist_names[d], phase_names[p],
+					  samples + p * opts.reps, opts.reps);
+		}
+	}
+
+	for (int i = 0; i < opts.files; ++i)
+		unlink(paths[i]);
+	free(paths);
+	free(numbers);
+	free(samples);
+	return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
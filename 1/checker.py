@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -10,11 +11,36 @@ parser.add_argument('-f', type=str, required=True, help="file name")
 args = parser.parse_args()
 
 
-f = open(args.f, 'r')
+def read_binary(data):
+	fmt, count = struct.unpack_from('<B3xQ', data, 4)
+	if fmt == 1:
+		return list(struct.unpack_from('<{}i'.format(count), data, 16))
+	res = []
+	pos = 16
+	prev = 0
+	for i in range(0, count):
+		v = 0
+		shift = 0
+		while True:
+			b = data[pos]
+			pos += 1
+			v |= (b & 0x7f) << shift
+			if b < 0x80:
+				break
+			shift += 7
+		prev += (v >> 1) ^ -(v & 1)
+		res.append(prev)
+	return res
+
+
+f = open(args.f, 'rb')
 data = f.read()
 f.close()
 
-data = data.split()
+if data[:4] == b'ISRT' and len(data) >= 16 and data[4] in (1, 2):
+	data = read_binary(data)
+else:
+	data = data.decode().split()
 prev_number = -(1 << 31 - 1)
 for i in range(0, len(data)):
 	try:
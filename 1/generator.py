@@ -1,21 +1,47 @@
 import random
 import argparse
+import struct
 
-maxint = 1 << 31
+maxint = (1 << 31) - 1
 
 parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-t', type=str, default='text',
+		    choices=['text', 'raw', 'varint'], help='file format')
 args = parser.parse_args()
 random.seed()
 
+formats = {'raw': 1, 'varint': 2}
 
-f = open(args.f, 'w')
+def zigzag(v):
+	return (v << 1) ^ (v >> 63)
 
-for i in range(0, args.c):
-	f.write(str(random.randint(0, args.m)))
-	if i + 1 != args.c:
-		f.write(' ')
+def varint(v):
+	res = bytearray()
+	while v >= 0x80:
+		res.append((v & 0x7f) | 0x80)
+		v >>= 7
+	res.append(v)
+	return res
 
-f.close()
+numbers = [random.randint(0, args.m) for i in range(0, args.c)]
+
+if args.t == 'text':
+	f = open(args.f, 'w')
+	f.write(' '.join(str(v) for v in numbers))
+	f.close()
+else:
+	f = open(args.f, 'wb')
+	f.write(b'ISRT' + struct.pack('<B3xQ', formats[args.t], args.c))
+	if args.t == 'raw':
+		f.write(struct.pack('<{}i'.format(args.c), *numbers))
+	else:
+		body = bytearray()
+		prev = 0
+		for v in numbers:
+			body += varint(zigzag(v - prev) & ((1 << 64) - 1))
+			prev = v
+		f.write(body)
+	f.close()
@@ -0,0 +1,693 @@
+#include "intfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char intfile_magic[4] = {'I', 'S', 'R', 'T'};
+
+enum {
+	/** Size of the buffer used to encode before fwrite(). */
+	INTFILE_WRITE_BUF = 64 * 1024,
+	/** Max size of an encoded 64-bit varint. */
+	VARINT_MAX_SIZE = 10,
+	/** Text smaller than that per thread is parsed in one thread. */
+	INTFILE_PARALLEL_CHUNK = 1024 * 1024,
+	/** Max threads parsing one text file. */
+	INTFILE_MAX_THREADS = 16,
+	/** Block size of a streaming scan. */
+	INTFILE_SCAN_BUF = 64 * 1024,
+};
+
+int
+intfile_format_from_str(const char *str, enum intfile_format *out)
+{
+	if (strcmp(str, "text") == 0)
+		*out = INTFILE_FORMAT_TEXT;
+	else if (strcmp(str, "raw") == 0)
+		*out = INTFILE_FORMAT_RAW;
+	else if (strcmp(str, "varint") == 0)
+		*out = INTFILE_FORMAT_VARINT;
+	else
+		return -1;
+	return 0;
+}
+
+static uint64_t
+load_u64_le(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	uint64_t res = 0;
+	for (int i = 7; i >= 0; --i)
+		res = (res << 8) | u[i];
+	return res;
+}
+
+static void
+store_u64_le(char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i) {
+		p[i] = (char)(v & 0xff);
+		v >>= 8;
+	}
+}
+
+enum intfile_format
+intfile_detect(const char *data, size_t size)
+{
+	if (size < INTFILE_HEADER_SIZE ||
+	    memcmp(data, intfile_magic, sizeof(intfile_magic)) != 0)
+		return INTFILE_FORMAT_TEXT;
+	unsigned char format = data[sizeof(intfile_magic)];
+	if (format == INTFILE_FORMAT_RAW || format == INTFILE_FORMAT_VARINT)
+		return format;
+	return INTFILE_FORMAT_TEXT;
+}
+
+static inline uint64_t
+zigzag_encode(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+zigzag_decode(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline bool
+text_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * A byte range of a text file parsed by one thread. The first pass
+ * only counts the numbers, the second one stores them to @a out,
+ * which is the range offset in the common result array.
+ */
+struct text_chunk {
+	const char *begin;
+	const char *end;
+	int *out;
+	size_t count;
+	/** A not-number was met, the rest of the file is ignored. */
+	bool is_stopped;
+	/** A number out of the int range was met, the file is malformed. */
+	bool is_overflow;
+};
+
+/** Parse a range, or only count the numbers if out is NULL. */
+static void *
+text_chunk_parse(void *arg)
+{
+	struct text_chunk *chunk = arg;
+	const char *pos = chunk->begin, *end = chunk->end;
+	int *out = chunk->out;
+	size_t count = 0;
+	chunk->is_stopped = false;
+	chunk->is_overflow = false;
+	while (true) {
+		while (pos < end && text_is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		bool is_neg = false;
+		if (*pos == '-' || *pos == '+') {
+			is_neg = *pos == '-';
+			++pos;
+		}
+		/* Like fscanf() - stop on the first not a number. */
+		if (pos == end || *pos < '0' || *pos > '9') {
+			chunk->is_stopped = true;
+			break;
+		}
+		/*
+		 * The value is checked on each digit, so a long digit run
+		 * can't overflow the accumulator.
+		 */
+		uint64_t limit = is_neg ? (uint64_t)INT_MAX + 1 : INT_MAX;
+		uint64_t v = 0;
+		while (pos < end && *pos >= '0' && *pos <= '9') {
+			v = v * 10 + (*pos++ - '0');
+			if (v > limit) {
+				chunk->is_overflow = true;
+				break;
+			}
+		}
+		if (chunk->is_overflow) {
+			chunk->is_stopped = true;
+			break;
+		}
+		if (out != NULL)
+			out[count] = is_neg ? (int)-(int64_t)v : (int)v;
+		++count;
+	}
+	chunk->count = count;
+	return NULL;
+}
+
+/** Run the chunk parser on all the chunks, one thread per chunk. */
+static int
+text_chunks_run(struct text_chunk *chunks, int chunk_count)
+{
+	pthread_t threads[INTFILE_MAX_THREADS];
+	int started = 0;
+	int rc = 0;
+	for (int i = 1; i < chunk_count; ++i) {
+		int err = pthread_create(&threads[i], NULL, text_chunk_parse,
+					 &chunks[i]);
+		if (err != 0) {
+			errno = err;
+			rc = -1;
+			break;
+		}
+		started = i;
+	}
+	text_chunk_parse(&chunks[0]);
+	for (int i = 1; i <= started; ++i)
+		pthread_join(threads[i], NULL);
+	return rc;
+}
+
+/**
+ * Parse text numbers. A big file is split into byte ranges by the
+ * CPU count, each boundary is moved to the next whitespace so no
+ * number is cut. The first parallel pass counts numbers in the
+ * ranges, that gives each range its offset in the result, and the
+ * second pass parses right into the final array. No reallocs and
+ * no concatenation copies.
+ */
+static int
+decode_text(const char *data, size_t size, int **numbers, size_t *count)
+{
+	struct text_chunk chunks[INTFILE_MAX_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t chunk_count = size / INTFILE_PARALLEL_CHUNK + 1;
+	if (chunk_count > (size_t)cpus)
+		chunk_count = cpus > 0 ? (size_t)cpus : 1;
+	if (chunk_count > INTFILE_MAX_THREADS)
+		chunk_count = INTFILE_MAX_THREADS;
+
+	const char *end = data + size;
+	const char *pos = data;
+	for (size_t i = 0; i < chunk_count; ++i) {
+		chunks[i].begin = pos;
+		const char *next = i == chunk_count - 1 ?
+				   end : data + size / chunk_count * (i + 1);
+		if (next < pos)
+			next = pos;
+		while (next < end && !text_is_space(*next))
+			++next;
+		chunks[i].end = next;
+		chunks[i].out = NULL;
+		pos = next;
+	}
+	if (chunk_count == 1) {
+		/*
+		 * One thread doesn't need the offsets. Each number takes
+		 * at least 2 bytes with a delimiter, so the count can be
+		 * bounded and the array is parsed in one pass.
+		 */
+		int *res = malloc((size / 2 + 2) * sizeof(*res));
+		if (res == NULL)
+			return -1;
+		chunks[0].out = res;
+		text_chunk_parse(&chunks[0]);
+		if (chunks[0].is_overflow) {
+			free(res);
+			errno = EINVAL;
+			return -1;
+		}
+		int *tmp = realloc(res, (chunks[0].count + 1) * sizeof(*res));
+		*numbers = tmp != NULL ? tmp : res;
+		*count = chunks[0].count;
+		return 0;
+	}
+	if (text_chunks_run(chunks, chunk_count) != 0)
+		return -1;
+
+	/* Numbers after the first garbage are not taken. */
+	size_t total = 0;
+	int used_chunks = 0;
+	while (used_chunks < (int)chunk_count) {
+		if (chunks[used_chunks].is_overflow) {
+			errno = EINVAL;
+			return -1;
+		}
+		total += chunks[used_chunks].count;
+		if (chunks[used_chunks++].is_stopped)
+			break;
+	}
+	/* malloc(0) can return NULL. */
+	int *res = malloc((total + 1) * sizeof(*res));
+	if (res == NULL)
+		return -1;
+	int *out = res;
+	for (int i = 0; i < used_chunks; ++i) {
+		chunks[i].out = out;
+		out += chunks[i].count;
+	}
+	if (text_chunks_run(chunks, used_chunks) != 0) {
+		free(res);
+		return -1;
+	}
+	*numbers = res;
+	*count = total;
+	return 0;
+}
+
+static void
+decode_raw(const char *pos, int *numbers, size_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(numbers, pos, count * sizeof(*numbers));
+#else
+	const unsigned char *u = (const unsigned char *)pos;
+	for (size_t i = 0; i < count; ++i, u += 4) {
+		numbers[i] = (int)((uint32_t)u[0] | (uint32_t)u[1] << 8 |
+				   (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24);
+	}
+#endif
+}
+
+/**
+ * Decode one varint and move @a pos past it.
+ * @retval 0 Success.
+ * @retval -1 The varint is cut by @a end or is too long.
+ */
+static int
+decode_varint_one(const unsigned char **pos, const unsigned char *end,
+		  uint64_t *out)
+{
+	const unsigned char *u = *pos;
+	uint64_t v = 0;
+	int shift = 0;
+	while (true) {
+		if (u == end || shift >= 64)
+			return -1;
+		unsigned char b = *u++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			break;
+		shift += 7;
+	}
+	*pos = u;
+	*out = v;
+	return 0;
+}
+
+static int
+decode_varint(const char *pos, const char *end, int *numbers, size_t count)
+{
+	const unsigned char *u = (const unsigned char *)pos;
+	const unsigned char *u_end = (const unsigned char *)end;
+	int64_t prev = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t v;
+		if (decode_varint_one(&u, u_end, &v) != 0)
+			return -1;
+		prev += zigzag_decode(v);
+		if (prev < INT_MIN || prev > INT_MAX)
+			return -1;
+		numbers[i] = (int)prev;
+	}
+	/* Like for raw, bytes after the last number mean a corrupt file. */
+	return u == u_end ? 0 : -1;
+}
+
+int
+intfile_decode(const char *data, size_t size, int **numbers, size_t *count)
+{
+	enum intfile_format format = intfile_detect(data, size);
+	if (format == INTFILE_FORMAT_TEXT)
+		return decode_text(data, size, numbers, count);
+
+	uint64_t n = load_u64_le(data + 8);
+	const char *pos = data + INTFILE_HEADER_SIZE;
+	size_t body_size = size - INTFILE_HEADER_SIZE;
+	/* No trailing bytes, a cut or corrupt file is not read silently. */
+	if (format == INTFILE_FORMAT_RAW &&
+	    (n > body_size / sizeof(int) || n * sizeof(int) != body_size)) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Each varint takes at least one byte. */
+	if (format == INTFILE_FORMAT_VARINT && n > body_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* malloc(0) can return NULL. */
+	int *res = malloc((n + 1) * sizeof(*res));
+	if (res == NULL)
+		return -1;
+	if (format == INTFILE_FORMAT_RAW) {
+		decode_raw(pos, res, n);
+	} else if (decode_varint(pos, data + size, res, n) != 0) {
+		free(res);
+		errno = EINVAL;
+		return -1;
+	}
+	*numbers = res;
+	*count = n;
+	return 0;
+}
+
+int
+intfile_load(const char *path, int **numbers, size_t *count)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return intfile_decode("", 0, numbers, count);
+	}
+	/*
+	 * The file is mapped instead of read so as to parse it right in
+	 * the page cache. The header tells the format, binary numbers
+	 * are just copied.
+	 */
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise(data, size, MADV_SEQUENTIAL);
+	int rc = intfile_decode(data, size, numbers, count);
+	munmap(data, size);
+	return rc;
+}
+
+/**
+ * State of a file being scanned block by block. Only the tail of a
+ * block which can't be decoded yet, like a cut number, is carried
+ * to the next block.
+ */
+struct intfile_scanner {
+	int fd;
+	char *buf;
+	size_t used;
+	bool is_eof;
+	bool is_header_read;
+	enum intfile_format format;
+	/** Binary formats - how many numbers are left. */
+	uint64_t left;
+	/** Varint format - the previous number to add a delta to. */
+	int64_t prev;
+	int *numbers;
+};
+
+static int
+scanner_fill(struct intfile_scanner *sc)
+{
+	while (sc->used < INTFILE_SCAN_BUF && !sc->is_eof) {
+		ssize_t rc = read(sc->fd, sc->buf + sc->used,
+				  INTFILE_SCAN_BUF - sc->used);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			sc->is_eof = true;
+		sc->used += rc;
+	}
+	return 0;
+}
+
+/**
+ * Decode numbers from the buffered bytes. @a consumed is how many
+ * bytes were used, @a is_stopped is set when nothing is left to
+ * decode in the file.
+ */
+static int
+scanner_decode(struct intfile_scanner *sc, size_t *count, size_t *consumed,
+	       bool *is_stopped)
+{
+	const char *buf = sc->buf;
+	*count = 0;
+	*consumed = 0;
+	*is_stopped = false;
+	if (sc->format == INTFILE_FORMAT_TEXT) {
+		size_t end = sc->used;
+		if (!sc->is_eof) {
+			/* Don't cut the last number - it can continue. */
+			while (end > 0 && !text_is_space(buf[end - 1]))
+				--end;
+			if (end == 0) {
+				/* A token longer than a block is not a number. */
+				*is_stopped = true;
+				return 0;
+			}
+		}
+		struct text_chunk chunk = {
+			.begin = buf,
+			.end = buf + end,
+			.out = sc->numbers,
+		};
+		text_chunk_parse(&chunk);
+		if (chunk.is_overflow) {
+			errno = EINVAL;
+			return -1;
+		}
+		*count = chunk.count;
+		*consumed = end;
+		*is_stopped = chunk.is_stopped || sc->is_eof;
+		return 0;
+	}
+	if (sc->format == INTFILE_FORMAT_RAW) {
+		size_t n = sc->used / sizeof(int);
+		if (n > sc->left)
+			n = sc->left;
+		decode_raw(buf, sc->numbers, n);
+		*count = n;
+		*consumed = n * sizeof(int);
+		sc->left -= n;
+	} else {
+		const unsigned char *u = (const unsigned char *)buf;
+		const unsigned char *end = u + sc->used;
+		size_t n = 0;
+		uint64_t v;
+		while (sc->left > 0 && decode_varint_one(&u, end, &v) == 0) {
+			sc->prev += zigzag_decode(v);
+			if (sc->prev < INT_MIN || sc->prev > INT_MAX) {
+				errno = EINVAL;
+				return -1;
+			}
+			sc->numbers[n++] = (int)sc->prev;
+			sc->left--;
+		}
+		*count = n;
+		*consumed = (const char *)u - buf;
+	}
+	*is_stopped = sc->left == 0;
+	/* The numbers are not all there but the file is over. */
+	if (sc->is_eof && !*is_stopped) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+intfile_scan(const char *path, intfile_scan_f cb, void *arg)
+{
+	struct intfile_scanner sc = {0};
+	int rc = -1;
+	sc.fd = open(path, O_RDONLY);
+	if (sc.fd < 0)
+		return -1;
+	sc.buf = malloc(INTFILE_SCAN_BUF);
+	/* A small varint delta takes just one byte. */
+	sc.numbers = malloc(INTFILE_SCAN_BUF * sizeof(int));
+	if (sc.buf == NULL || sc.numbers == NULL)
+		goto out;
+	while (true) {
+		if (scanner_fill(&sc) != 0)
+			goto out;
+		if (!sc.is_header_read) {
+			sc.is_header_read = true;
+			sc.format = intfile_detect(sc.buf, sc.used);
+			if (sc.format != INTFILE_FORMAT_TEXT) {
+				sc.left = load_u64_le(sc.buf + 8);
+				sc.used -= INTFILE_HEADER_SIZE;
+				memmove(sc.buf, sc.buf + INTFILE_HEADER_SIZE,
+					sc.used);
+				continue;
+			}
+		}
+		size_t count, consumed;
+		bool is_stopped;
+		if (scanner_decode(&sc, &count, &consumed, &is_stopped) != 0)
+			goto out;
+		if (count > 0) {
+			int cb_rc = cb(sc.numbers, count, arg);
+			if (cb_rc != 0) {
+				rc = cb_rc;
+				goto out;
+			}
+		}
+		if (is_stopped) {
+			/*
+			 * Like in intfile_decode(), bytes after the last binary
+			 * number mean a corrupt file.
+			 */
+			sc.used -= consumed;
+			if (sc.format != INTFILE_FORMAT_TEXT && sc.used == 0 &&
+			    scanner_fill(&sc) != 0)
+				goto out;
+			if (sc.format != INTFILE_FORMAT_TEXT && sc.used > 0) {
+				errno = EINVAL;
+				goto out;
+			}
+			rc = 0;
+			goto out;
+		}
+		if (consumed == 0 && sc.is_eof)
+			goto out;
+		sc.used -= consumed;
+		memmove(sc.buf, sc.buf + consumed, sc.used);
+	}
+out:
+	free(sc.buf);
+	free(sc.numbers);
+	close(sc.fd);
+	return rc;
+}
+
+/** SplitMix64 finalizer - a cheap well mixing hash. */
+static inline uint64_t
+fingerprint_hash(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+void
+intfile_fingerprint_add(struct intfile_fingerprint *fp, const int *numbers,
+			size_t count)
+{
+	uint64_t sum = 0, hash_xor = 0, hash_sum = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t h = fingerprint_hash((uint32_t)numbers[i]);
+		sum += (uint64_t)(int64_t)numbers[i];
+		hash_xor ^= h;
+		hash_sum += h;
+	}
+	fp->count += count;
+	fp->sum += sum;
+	fp->hash_xor ^= hash_xor;
+	fp->hash_sum += hash_sum;
+}
+
+void
+intfile_fingerprint_merge(struct intfile_fingerprint *dst,
+			  const struct intfile_fingerprint *src)
+{
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->hash_xor ^= src->hash_xor;
+	dst->hash_sum += src->hash_sum;
+}
+
+bool
+intfile_fingerprint_eq(const struct intfile_fingerprint *a,
+		       const struct intfile_fingerprint *b)
+{
+	return a->count == b->count && a->sum == b->sum &&
+	       a->hash_xor == b->hash_xor && a->hash_sum == b->hash_sum;
+}
+
+static int
+write_text(FILE *f, const int *numbers, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (fprintf(f, "%d ", numbers[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+write_raw(FILE *f, const int *numbers, size_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (fwrite(numbers, sizeof(*numbers), count, f) != count)
+		return -1;
+#else
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t v = (uint32_t)numbers[i];
+		unsigned char b[4] = {v & 0xff, (v >> 8) & 0xff,
+				      (v >> 16) & 0xff, v >> 24};
+		if (fwrite(b, 1, sizeof(b), f) != sizeof(b))
+			return -1;
+	}
+#endif
+	return 0;
+}
+
+static int
+write_varint(FILE *f, const int *numbers, size_t count)
+{
+	char *buf = malloc(INTFILE_WRITE_BUF);
+	if (buf == NULL)
+		return -1;
+	size_t used = 0;
+	int64_t prev = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (INTFILE_WRITE_BUF - used < VARINT_MAX_SIZE) {
+			if (fwrite(buf, 1, used, f) != used)
+				goto error;
+			used = 0;
+		}
+		uint64_t v = zigzag_encode((int64_t)numbers[i] - prev);
+		prev = numbers[i];
+		while (v >= 0x80) {
+			buf[used++] = (char)(v | 0x80);
+			v >>= 7;
+		}
+		buf[used++] = (char)v;
+	}
+	if (fwrite(buf, 1, used, f) != used)
+		goto error;
+	free(buf);
+	return 0;
+error:
+	free(buf);
+	return -1;
+}
+
+int
+intfile_write(FILE *f, enum intfile_format format, const int *numbers,
+	      size_t count)
+{
+	if (format == INTFILE_FORMAT_TEXT)
+		return write_text(f, numbers, count);
+
+	char header[INTFILE_HEADER_SIZE] = {0};
+	memcpy(header, intfile_magic, sizeof(intfile_magic));
+	header[sizeof(intfile_magic)] = (char)format;
+	store_u64_le(header + 8, count);
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header))
+		return -1;
+	if (format == INTFILE_FORMAT_RAW)
+		return write_raw(f, numbers, count);
+	return write_varint(f, numbers, count);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Formats of the files with numbers. The text one is the original
+ * format - ASCII numbers separated by whitespaces. Binary files
+ * start with a header so the format is detected automatically on
+ * read:
+ *
+ *     char magic[4] = "ISRT";
+ *     uint8_t format;       // enum intfile_format.
+ *     uint8_t reserved[3];
+ *     uint64_t count;       // Little-endian number count.
+ *
+ * and then the numbers go.
+ */
+enum intfile_format {
+	INTFILE_FORMAT_TEXT = 0,
+	/** Raw little-endian int32 numbers. */
+	INTFILE_FORMAT_RAW = 1,
+	/**
+	 * The first number and then the deltas between the
+	 * neighbours, each zigzag-encoded into an LEB128 varint.
+	 * Sorted data takes 1-2 bytes per number here.
+	 */
+	INTFILE_FORMAT_VARINT = 2,
+};
+
+enum {
+	INTFILE_HEADER_SIZE = 16,
+};
+
+/**
+ * Parse a format name: "text", "raw" or "varint".
+ * @retval 0 Success.
+ * @retval -1 Unknown name.
+ */
+int
+intfile_format_from_str(const char *str, enum intfile_format *out);
+
+/** Detect format of a file image by its header. */
+enum intfile_format
+intfile_detect(const char *data, size_t size);
+
+/**
+ * Decode all numbers from a file image of any format. On success
+ * @a numbers is a new array which has to be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Malformed data (errno is EINVAL) or no memory.
+ */
+int
+intfile_decode(const char *data, size_t size, int **numbers, size_t *count);
+
+/**
+ * Read a whole file of any format and decode it. On success
+ * @a numbers is a new array which has to be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL - malformed data.
+ */
+int
+intfile_load(const char *path, int **numbers, size_t *count);
+
+/**
+ * Called by intfile_scan() for each decoded block of numbers. Not 0
+ * return code stops the scan and is returned from it.
+ */
+typedef int (*intfile_scan_f)(const int *numbers, size_t count, void *arg);
+
+/**
+ * Stream a file of any format block by block without loading it
+ * whole. Memory usage doesn't depend on the file size.
+ * @retval 0 Success.
+ * @retval -1 IO error or malformed data (errno is EINVAL).
+ * @retval Other - the callback's code.
+ */
+int
+intfile_scan(const char *path, intfile_scan_f cb, void *arg);
+
+/**
+ * Order-independent fingerprint of a multiset of numbers. Equal
+ * multisets have equal fingerprints regardless of the order, and
+ * fingerprints of parts can be merged into the fingerprint of the
+ * whole. So a sorted output can be checked against the inputs
+ * without keeping either of them.
+ */
+struct intfile_fingerprint {
+	uint64_t count;
+	/** Wrapping sum of the numbers. */
+	uint64_t sum;
+	/** Xor and wrapping sum of the numbers' hashes. */
+	uint64_t hash_xor;
+	uint64_t hash_sum;
+};
+
+void
+intfile_fingerprint_add(struct intfile_fingerprint *fp, const int *numbers,
+			size_t count);
+
+void
+intfile_fingerprint_merge(struct intfile_fingerprint *dst,
+			  const struct intfile_fingerprint *src);
+
+bool
+intfile_fingerprint_eq(const struct intfile_fingerprint *a,
+		       const struct intfile_fingerprint *b);
+
+/**
+ * Write the numbers into a file in the given format.
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+int
+intfile_write(FILE *f, enum intfile_format format, const int *numbers,
+	      size_t count);
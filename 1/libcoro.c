@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -5,6 +6,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <ucontext.h>
 #include "libcoro.h"
 #include <time.h>
 
@@ -196,9 +198,25 @@ coro_this(void)
  * coroutine constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_body(int signum, siginfo_t *info, void *ucontext)
 {
 	(void)signum;
+	(void)info;
+	/*
+	 * The handler never returns, it jumps away. But its frame stays
+	 * at the bottom of the coroutine stack, and an unwinder like
+	 * backtrace() goes from there to the context the signal came
+	 * to - coro_new() frames long gone from the main stack. A zero
+	 * return address there ends the unwinding.
+	 */
+	ucontext_t *uc = ucontext;
+#if defined(__linux__) && defined(__x86_64__)
+	uc->uc_mcontext.gregs[REG_RIP] = 0;
+#elif defined(__linux__) && defined(__aarch64__)
+	uc->uc_mcontext.pc = 0;
+#else
+	(void)uc;
+#endif
 	struct coro *c = coro_this_ptr;
 	coro_this_ptr = NULL;
 	/*
@@ -262,8 +280,8 @@ coro_new(coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
+	newsa.sa_sigaction = coro_body;
+	newsa.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
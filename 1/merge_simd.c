@@ -0,0 +1,226 @@
+#include "merge_simd.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MERGE_HAVE_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MERGE_HAVE_NEON 1
+#endif
+
+enum {
+	/** The widest vector is 8 ints of AVX2. */
+	MERGE_MAX_WIDTH = 8,
+};
+
+/**
+ * Branchless scalar merge. The comparison result is used as an
+ * index increment instead of a jump, so random data doesn't cause
+ * branch mispredictions.
+ */
+static void
+merge_int32_scalar(const int *a, size_t na, const int *b, size_t nb,
+		   int *out)
+{
+	const int *a_end = a + na, *b_end = b + nb;
+	while (a < a_end && b < b_end) {
+		bool take_a = *a <= *b;
+		*out++ = take_a ? *a : *b;
+		a += take_a;
+		b += !take_a;
+	}
+	memcpy(out, a, (a_end - a) * sizeof(*a));
+	out += a_end - a;
+	/* In an in-place merge the right tail can be in place already. */
+	memmove(out, b, (b_end - b) * sizeof(*b));
+}
+
+/**
+ * Finish a vector merge. @a hi holds the last register with the
+ * biggest of the already loaded numbers, one of the array tails is
+ * shorter than a vector.
+ */
+static void
+merge_int32_tail(const int *hi, size_t hi_size, const int *a, size_t na,
+		 const int *b, size_t nb, int *out)
+{
+	int buf[2 * MERGE_MAX_WIDTH];
+	if (na > nb) {
+		const int *tmp = a;
+		a = b;
+		b = tmp;
+		size_t tmp_size = na;
+		na = nb;
+		nb = tmp_size;
+	}
+	merge_int32_scalar(hi, hi_size, a, na, buf);
+	merge_int32_scalar(buf, hi_size + na, b, nb, out);
+}
+
+/**
+ * The common merge loop for all the vector kernels. Two registers
+ * are merged with a bitonic network, the lower half goes to the
+ * output, and the upper half stays to be merged with the next
+ * vector from the array with the smaller head.
+ */
+#define MERGE_SIMD_LOOP(width, vec_t, load, store, merge2) do {		\
+	if (na < (width) || nb < (width)) {				\
+		merge_int32_scalar(a, na, b, nb, out);			\
+		return;							\
+	}								\
+	const int *a_end = a + na, *b_end = b + nb;			\
+	vec_t lo = load(a), hi = load(b);				\
+	a += (width);							\
+	b += (width);							\
+	while (true) {							\
+		merge2(&lo, &hi);					\
+		store(out, lo);						\
+		out += (width);						\
+		if (a_end - a < (width) || b_end - b < (width))		\
+			break;						\
+		if (*a <= *b) {						\
+			lo = load(a);					\
+			a += (width);					\
+		} else {						\
+			lo = load(b);					\
+			b += (width);					\
+		}							\
+	}								\
+	int tail[(width)];						\
+	store(tail, hi);						\
+	merge_int32_tail(tail, (width), a, a_end - a, b, b_end - b, out);\
+} while (0)
+
+#if MERGE_HAVE_X86
+
+#define avx2_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define avx2_store(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define sse_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define sse_store(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+
+/** Sort a bitonic sequence of 8 ints. */
+__attribute__((target("avx2")))
+static inline __m256i
+bitonic_sort8_avx2(__m256i v)
+{
+	__m256i p = _mm256_permute2x128_si256(v, v, 1);
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, p),
+			       _mm256_max_epi32(v, p), 0xF0);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, p),
+			       _mm256_max_epi32(v, p), 0xCC);
+	p = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, p),
+			       _mm256_max_epi32(v, p), 0xAA);
+	return v;
+}
+
+/**
+ * Merge two sorted vectors. 8 smallest numbers end up sorted in
+ * @a lo, 8 biggest - in @a hi.
+ */
+__attribute__((target("avx2")))
+static inline void
+bitonic_merge8_avx2(__m256i *lo, __m256i *hi)
+{
+	__m256i rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i b = _mm256_permutevar8x32_epi32(*hi, rev);
+	__m256i l = _mm256_min_epi32(*lo, b);
+	__m256i h = _mm256_max_epi32(*lo, b);
+	*lo = bitonic_sort8_avx2(l);
+	*hi = bitonic_sort8_avx2(h);
+}
+
+__attribute__((target("avx2")))
+static void
+merge_int32_avx2(const int *a, size_t na, const int *b, size_t nb, int *out)
+{
+	MERGE_SIMD_LOOP(8, __m256i, avx2_load, avx2_store,
+			bitonic_merge8_avx2);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+bitonic_sort4_sse(__m128i v)
+{
+	__m128i p = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm_blend_epi16(_mm_min_epi32(v, p), _mm_max_epi32(v, p), 0xF0);
+	p = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm_blend_epi16(_mm_min_epi32(v, p), _mm_max_epi32(v, p), 0xCC);
+	return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline void
+bitonic_merge4_sse(__m128i *lo, __m128i *hi)
+{
+	__m128i b = _mm_shuffle_epi32(*hi, _MM_SHUFFLE(0, 1, 2, 3));
+	__m128i l = _mm_min_epi32(*lo, b);
+	__m128i h = _mm_max_epi32(*lo, b);
+	*lo = bitonic_sort4_sse(l);
+	*hi = bitonic_sort4_sse(h);
+}
+
+__attribute__((target("sse4.1")))
+static void
+merge_int32_sse(const int *a, size_t na, const int *b, size_t nb, int *out)
+{
+	MERGE_SIMD_LOOP(4, __m128i, sse_load, sse_store, bitonic_merge4_sse);
+}
+
+#endif /* MERGE_HAVE_X86 */
+
+#if MERGE_HAVE_NEON
+
+static inline int32x4_t
+bitonic_sort4_neon(int32x4_t v)
+{
+	int32x4_t p = vextq_s32(v, v, 2);
+	int32x4_t mn = vminq_s32(v, p), mx = vmaxq_s32(v, p);
+	v = vcombine_s32(vget_low_s32(mn), vget_low_s32(mx));
+	p = vrev64q_s32(v);
+	mn = vminq_s32(v, p);
+	mx = vmaxq_s32(v, p);
+	return vtrn1q_s32(mn, mx);
+}
+
+static inline void
+bitonic_merge4_neon(int32x4_t *lo, int32x4_t *hi)
+{
+	int32x4_t r = vrev64q_s32(*hi);
+	int32x4_t b = vcombine_s32(vget_high_s32(r), vget_low_s32(r));
+	int32x4_t l = vminq_s32(*lo, b);
+	int32x4_t h = vmaxq_s32(*lo, b);
+	*lo = bitonic_sort4_neon(l);
+	*hi = bitonic_sort4_neon(h);
+}
+
+static void
+merge_int32_neon(const int *a, size_t na, const int *b, size_t nb, int *out)
+{
+	MERGE_SIMD_LOOP(4, int32x4_t, vld1q_s32, vst1q_s32,
+			bitonic_merge4_neon);
+}
+
+#endif /* MERGE_HAVE_NEON */
+
+void
+merge_int32(const int *left, size_t left_size, const int *right,
+	    size_t right_size, int *result)
+{
+#if MERGE_HAVE_X86
+	if (__builtin_cpu_supports("avx2"))
+		merge_int32_avx2(left, left_size, right, right_size, result);
+	else if (__builtin_cpu_supports("sse4.1"))
+		merge_int32_sse(left, left_size, right, right_size, result);
+	else
+		merge_int32_scalar(left, left_size, right, right_size, result);
+#elif MERGE_HAVE_NEON
+	merge_int32_neon(left, left_size, right, right_size, result);
+#else
+	merge_int32_scalar(left, left_size, right, right_size, result);
+#endif
+}
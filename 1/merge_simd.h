@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Merge two sorted int arrays into @a result. The kernel is picked
+ * at runtime by the CPU features: bitonic merge networks on 8-wide
+ * AVX2 or 4-wide SSE4.1 vectors on x86, 4-wide NEON on AArch64, and
+ * a branchless scalar loop otherwise.
+ *
+ * The output never overtakes the right input, so @a result can
+ * start exactly @a left_size elements before @a right. That allows
+ * to merge in place having only the left run copied aside.
+ */
+void
+merge_int32(const int *left, size_t left_size, const int *right,
+	    size_t right_size, int *result);
@@ -1,34 +1,72 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "libcoro.h"
+#include "intfile.h"
+#include "sort.h"
 #include <time.h>
 
 /**
  * You can compile and run this code using the commands:
  *
- * $> gcc solution.c libcoro.c
- * $> ./a.out
+ * $> gcc solution.c libcoro.c intfile.c merge_simd.c sort.c
+ * $> ./a.out [--format text|raw|varint] [--top K | --bottom K | --select P]
+ *           [--verify] file1 file2 ...
+ *
+ * Input files can be in any format, it is detected by a header.
+ * --format sets the format of outfile.txt, text by default.
+ * --top and --bottom write only the first or the last K numbers of
+ * the sorted output, --select writes the number at the percentile P
+ * (from 0 to 100). They don't sort the files fully.
+ * --verify streams outfile.txt back after the sort and checks that it
+ * is sorted and holds exactly the input numbers. Only fingerprints of
+ * the inputs are kept for that, not the numbers.
  */
 
+enum sort_mode
+{
+	SORT_MODE_FULL,
+	SORT_MODE_TOP,
+	SORT_MODE_BOTTOM,
+	SORT_MODE_SELECT,
+};
+
+struct sort_opts
+{
+	enum sort_mode mode;
+	/** Number count for the top and bottom modes. */
+	size_t k;
+	/** Percentile for the select mode. */
+	double percentile;
+	enum intfile_format out_format;
+	bool is_verify;
+};
+
 struct int_array
 {
 	int *numbers;
 	size_t size;
+	/** Fingerprint of the numbers as they were read, for --verify. */
+	struct intfile_fingerprint fingerprint;
 };
 
 struct my_context
 {
 	char *name;
 	struct int_array *array;
+	const struct sort_opts *opts;
 };
 
 static struct my_context *
-my_context_new(const char *name, struct int_array *array)
+my_context_new(const char *name, struct int_array *array,
+	       const struct sort_opts *opts)
 {
 	struct my_context *ctx = malloc(sizeof(*ctx));
 	ctx->name = strdup(name);
 	ctx->array = array;
+	ctx->opts = opts;
 	return ctx;
 }
 
@@ -39,116 +77,26 @@ my_context_delete(struct my_context *ctx)
 	free(ctx);
 }
 
-/*н
-Пояснения к сортировке:
-У нас есть предмет "Углубленный C", на котором мы реализовывали вручную mergesort для разных типов данных.
-Компаратор, функции my_memcpy, merge и mergesort взяты оттуда.
-*/
-
-int int_gt_comparator(const void *a, const void *b)
-{
-	return *(int *)a - *(int *)b;
-}
-
-void my_memcpy(void *_dst, void *_src, size_t n)
-{
-	char *dst = (char *)_dst;
-	char *src = (char *)_src;
-
-	while (n)
-	{
-		*(dst++) = *(src++);
-		n--;
-	}
-}
-
-void merge(
-	void *left_start, void *right_start,
-	size_t left_size, size_t right_size,
-	size_t element_size,
-	int (*comparator)(const void *, const void *),
-	void *result)
+static void
+print_read_error(const char *name)
 {
-	size_t cur_left = 0, cur_right = 0, cur_result = 0;
-	while (cur_left < left_size && cur_right < right_size)
-	{
-		if (comparator(left_start + cur_left * element_size, right_start + cur_right * element_size) <= 0)
-		{
-			my_memcpy(result + cur_result * element_size, left_start + cur_left * element_size, element_size);
-			cur_left++;
-		}
-		else
-		{
-			my_memcpy(result + cur_result * element_size, right_start + cur_right * element_size, element_size);
-			cur_right++;
-		}
-		cur_result++;
-	}
-
-	while (cur_left < left_size)
-	{
-		my_memcpy(result + cur_result * element_size, left_start + cur_left * element_size, element_size);
-		cur_left++;
-		cur_result++;
-	}
-
-	while (cur_right < right_size)
-	{
-		my_memcpy(result + cur_result * element_size, right_start + cur_right * element_size, element_size);
-		cur_right++;
-		cur_result++;
-	}
+	printf("Error while reading file %s: %s\n", name,
+	       errno == EINVAL ? "malformed data" : strerror(errno));
 }
 
 int read_file(struct my_context *ctx, struct int_array *res)
 {
-	FILE *infile = fopen(ctx->name, "r");
-	if (!infile)
+	if (intfile_load(ctx->name, &res->numbers, &res->size) != 0)
 	{
-		printf("Error while opening file");
+		print_read_error(ctx->name);
 		return -1;
 	}
-
-	size_t cap = 10, size = 0;
-	int *numbers = (int *)malloc(cap * sizeof(int));
-
-	if (numbers == NULL) {
-		fclose(infile);
-		return -1;
-	}
-	
-	int number;
-	while (fscanf(infile, "%d", &number) == 1) {
-		numbers[size++] = number;
-
-		if (size >= cap) {
-			cap *= 2;
-			int* temp = realloc(numbers, cap * sizeof(int));
-			if (temp == NULL) {
-				printf("Error allocating memory\n");
-				free(numbers);
-				fclose(infile);
-				return -1;
-			}
-			numbers = temp;
-		}
-	}
-	
-	if (ferror(infile) != 0) {
-		fclose(infile);
-		free(numbers);
-		return -1;
-	}
-
-	res->numbers = numbers;
-	res->size = size;
-
-	fclose(infile);
-
+	if (ctx->opts->is_verify)
+		intfile_fingerprint_add(&res->fingerprint, res->numbers, res->size);
 	return 0;
 }
 
-int write_file(int *array, size_t len)
+int write_file(int *array, size_t len, enum intfile_format format)
 {
 	FILE *outfile = fopen("outfile.txt", "w");
 	if (!outfile)
@@ -157,56 +105,99 @@ int write_file(int *array, size_t len)
 		return -1;
 	}
 
-	for (size_t i = 0; i < len; i++)
-	{
-		fprintf(outfile, "%d ", array[i]);
-	}
+	int rc = intfile_write(outfile, format, array, len);
+	if (fclose(outfile) != 0)
+		rc = -1;
 
-	fclose(outfile);
-
-	return 0;
+	return rc;
 }
 
-int mergesort(
-	void *array,
-	size_t elements,
-	size_t element_size,
-	int (*comparator)(const void *, const void *))
+struct verify_state
 {
+	size_t count;
+	int prev;
+	bool is_sorted;
+	struct intfile_fingerprint fingerprint;
+};
 
-	if (elements <= 1)
+static int
+verify_block(const int *numbers, size_t count, void *arg)
+{
+	struct verify_state *state = arg;
+	for (size_t i = 0; i < count; ++i)
 	{
-		return 0;
+		if (state->count + i > 0 && numbers[i] < state->prev)
+		{
+			printf("Verify: not sorted at %zu: %d > %d\n",
+			       state->count + i, state->prev, numbers[i]);
+			state->is_sorted = false;
+			return 1;
+		}
+		state->prev = numbers[i];
 	}
+	state->count += count;
+	intfile_fingerprint_add(&state->fingerprint, numbers, count);
+	return 0;
+}
 
-	size_t middle = elements / 2;
-	void *left = array;
-	void *right = (char *)array + middle * element_size;
-
-	int mergesort_res;
-	mergesort_res = mergesort(left, middle, element_size, comparator);
-	if (mergesort_res == -1)
+/**
+ * Check the written output is sorted and is a permutation of the
+ * input. The file is scanned by blocks, so it is never loaded whole.
+ */
+static int
+verify_output(const char *path, const struct intfile_fingerprint *expected)
+{
+	struct verify_state state = {.is_sorted = true};
+	int rc = intfile_scan(path, verify_block, &state);
+	if (!state.is_sorted)
+		return -1;
+	if (rc != 0)
 	{
+		printf("Verify: can't read %s\n", path);
 		return -1;
 	}
-	yield_coro_period_end();
-
-	mergesort(right, elements - middle, element_size, comparator);
-	if (mergesort_res == -1)
+	if (!intfile_fingerprint_eq(&state.fingerprint, expected))
 	{
+		if (state.count != expected->count)
+			printf("Verify: %s has %zu numbers instead of %llu\n", path,
+			       state.count, (unsigned long long)expected->count);
+		else
+			printf("Verify: %s has other numbers than the input\n", path);
 		return -1;
 	}
+	printf("Verify: OK, %zu numbers\n", state.count);
+	return 0;
+}
+
+static int
+edge_block(const int *numbers, size_t count, void *arg)
+{
+	struct int32_topk *topk = arg;
+	if (int32_topk_push(topk, numbers, count) != 0)
+		return -1;
 	yield_coro_period_end();
+	return 0;
+}
 
-	void *temp = malloc(elements * element_size);
-	if (!temp)
+/**
+ * Read only the @a k smallest (@a is_head) or biggest numbers of the
+ * file, sorted. The file is streamed by blocks through a bounded
+ * heap, so the memory is O(K) whatever the file size is.
+ */
+static int
+read_file_edge(struct my_context *ctx, struct int_array *res, bool is_head)
+{
+	struct int32_topk topk;
+	int32_topk_create(&topk, ctx->opts->k, !is_head);
+	int rc = intfile_scan(ctx->name, edge_block, &topk);
+	if (rc == 0)
+		rc = int32_topk_finish(&topk, &res->numbers, &res->size);
+	int32_topk_destroy(&topk);
+	if (rc != 0)
 	{
+		print_read_error(ctx->name);
 		return -1;
 	}
-	merge(left, right, middle, elements - middle, element_size, comparator, temp);
-	my_memcpy(array, temp, elements * element_size);
-	free(temp);
-
 	return 0;
 }
 
@@ -220,14 +211,29 @@ coroutine_func_f(void *context)
 	struct my_context *ctx = context;
 	char *name = ctx->name;
 
-	if (read_file(ctx, ctx->array) != 0)
+	int rc;
+	if (ctx->opts->mode == SORT_MODE_TOP || ctx->opts->mode == SORT_MODE_BOTTOM)
+		rc = read_file_edge(ctx, ctx->array, ctx->opts->mode == SORT_MODE_TOP);
+	else
+		rc = read_file(ctx, ctx->array);
+	if (rc != 0)
 	{
-		printf("Error reading from file %s", ctx->name);
+		my_context_delete(ctx);
 		return -1;
 	}
 
 	yield_coro_period_end();
-	mergesort(ctx->array->numbers, ctx->array->size, sizeof(int), int_gt_comparator);
+	/*
+	 * The edge modes are sorted while read. For select the rank is
+	 * known only when all the files are read.
+	 */
+	if (ctx->opts->mode == SORT_MODE_FULL &&
+	    mergesort(ctx->array->numbers, ctx->array->size, sizeof(int), int_gt_comparator) != 0)
+	{
+		printf("Error while sorting file %s\n", name);
+		my_context_delete(ctx);
+		return -1;
+	}
 
 	printf("%s: yield\n", name);
 
@@ -238,7 +244,60 @@ coroutine_func_f(void *context)
 
 int main(int argc, char **argv)
 {
-	if (argc < 2)
+	struct sort_opts opts = {
+		.mode = SORT_MODE_FULL,
+		.out_format = INTFILE_FORMAT_TEXT,
+	};
+	int files_offset = 1;
+	while (files_offset < argc && strncmp(argv[files_offset], "--", 2) == 0)
+	{
+		const char *opt = argv[files_offset];
+		if (strcmp(opt, "--verify") == 0)
+		{
+			opts.is_verify = true;
+			++files_offset;
+			continue;
+		}
+		const char *val = files_offset + 1 < argc ? argv[files_offset + 1] : NULL;
+		char *end = NULL;
+		files_offset += 2;
+		if (val == NULL)
+		{
+			printf("Option %s needs a value\n", opt);
+			return EXIT_FAILURE;
+		}
+		if (strcmp(opt, "--format") == 0 &&
+		    intfile_format_from_str(val, &opts.out_format) == 0)
+		{
+			continue;
+		}
+		if ((strcmp(opt, "--top") == 0 || strcmp(opt, "--bottom") == 0) &&
+		    val[0] >= '0' && val[0] <= '9')
+		{
+			opts.mode = opt[2] == 't' ? SORT_MODE_TOP : SORT_MODE_BOTTOM;
+			opts.k = strtoull(val, &end, 10);
+			if (*end == 0)
+				continue;
+		}
+		if (strcmp(opt, "--select") == 0)
+		{
+			opts.mode = SORT_MODE_SELECT;
+			opts.percentile = strtod(val, &end);
+			if (end != val && *end == 0 && opts.percentile >= 0 &&
+			    opts.percentile <= 100)
+				continue;
+		}
+		printf("Unknown or bad option %s %s\n", opt, val);
+		return EXIT_FAILURE;
+	}
+
+	if (opts.is_verify && opts.mode != SORT_MODE_FULL)
+	{
+		printf("--verify works only with a full sort\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc - files_offset < 1)
 	{
 		printf("Incorrect amount of input args!\n");
 		return EXIT_FAILURE;
@@ -251,20 +310,20 @@ int main(int argc, char **argv)
 	clock_gettime(CLOCK_MONOTONIC, &time);
   	long long start_time = (time.tv_sec * 1000000 + time.tv_nsec / 1000);
 
-	int files_num = argc - 1;
-	int files_offset = 1;
+	int files_num = argc - files_offset;
 
-	struct int_array **integers = malloc(sizeof(struct int_array) * (argc - 1));
+	struct int_array **integers = malloc(sizeof(struct int_array) * files_num);
 	/* Start several coroutines. */
 	for (int i = 0; i < files_num; ++i)
 	{
-		struct int_array *array = malloc(sizeof(struct int_array));
-		coro_new(coroutine_func_f, my_context_new(argv[i + files_offset], array));
+		struct int_array *array = calloc(1, sizeof(struct int_array));
+		coro_new(coroutine_func_f, my_context_new(argv[i + files_offset], array, &opts));
 		integers[i] = array;
 	}
 
 	/* Wait for all the coroutines to end. */
 	struct coro *c;
+	int failed_count = 0;
 	while ((c = coro_sched_wait()) != NULL)
 	{
 		/*
@@ -274,25 +333,111 @@ int main(int argc, char **argv)
 		 */
 		printf("Finished, code: %d, switched coro: %lld, time_worked: %lld us\n", coro_status(c), coro_switch_count(c), coro_time_working(c));
 		printf("==========\n");
+		if (coro_status(c) != 0)
+			++failed_count;
 		coro_delete(c);
 	}
 
-	int *result_array = malloc(0);
-	int result_length = 0;
+	/*
+	 * An output without the numbers of a bad file would look fine,
+	 * and --verify would approve it as the file added nothing to
+	 * the expected fingerprint.
+	 */
+	if (failed_count > 0)
+	{
+		printf("%d of %d files are not read, outfile.txt is not written\n",
+		       failed_count, files_num);
+		for (int i = 0; i < files_num; ++i)
+		{
+			free(integers[i]->numbers);
+			free(integers[i]);
+		}
+		free(integers);
+		return EXIT_FAILURE;
+	}
 
-	for (int i = 0; i < files_num; ++i)
+	int *result_array;
+	size_t result_length = 0;
+	struct intfile_fingerprint expected = {0};
+
+	if (opts.mode == SORT_MODE_SELECT)
+	{
+		/* Not sorted, the numbers are just gathered in one array. */
+		size_t total = 0;
+		for (int i = 0; i < files_num; ++i)
+			total += integers[i]->size;
+		result_array = malloc((total + 1) * sizeof(int));
+	}
+	else
+	{
+		result_array = malloc(sizeof(int));
+	}
+	if (result_array == NULL)
 	{
-		int *temp = malloc((result_length + integers[i]->size) * sizeof(int));
+		printf("No memory for the result\n");
+		for (int i = 0; i < files_num; ++i)
+		{
+			free(integers[i]->numbers);
+			free(integers[i]);
+		}
+		free(integers);
+		return EXIT_FAILURE;
+	}
 
-		merge(result_array, integers[i]->numbers, result_length, integers[i]->size, sizeof(int), int_gt_comparator, temp);
+	for (int i = 0; i < files_num; ++i)
+	{
+		if (opts.mode == SORT_MODE_SELECT)
+		{
+			memcpy(result_array + result_length, integers[i]->numbers,
+			       integers[i]->size * sizeof(int));
+			result_length += integers[i]->size;
+		}
+		else
+		{
+			int *temp = malloc((result_length + integers[i]->size) * sizeof(int));
+			merge(result_array, integers[i]->numbers, result_length, integers[i]->size, sizeof(int), int_gt_comparator, temp);
+			result_length += integers[i]->size;
+			free(result_array);
+			result_array = temp;
+		}
+		/*
+		 * Each file gave its K edge numbers, only K of all are kept,
+		 * so the merges copy O(K) per file.
+		 */
+		if (opts.mode == SORT_MODE_TOP && result_length > opts.k)
+		{
+			result_length = opts.k;
+		}
+		else if (opts.mode == SORT_MODE_BOTTOM && result_length > opts.k)
+		{
+			memmove(result_array, result_array + result_length - opts.k,
+				opts.k * sizeof(int));
+			result_length = opts.k;
+		}
+		intfile_fingerprint_merge(&expected, &integers[i]->fingerprint);
 		free(integers[i]->numbers);
-		result_length += integers[i]->size;
 		free(integers[i]);
-		free(result_array);
-		result_array = temp;
 	}
 
-	if (write_file(result_array, result_length) != 0)
+	int *output = result_array;
+	size_t output_length = result_length;
+	if (opts.mode == SORT_MODE_SELECT)
+	{
+		if (result_length == 0)
+		{
+			printf("No numbers to select from\n");
+			free(result_array);
+			free(integers);
+			return -1;
+		}
+		size_t rank = (size_t)(opts.percentile / 100 * (result_length - 1));
+		int32_select(result_array, result_length, rank);
+		output = result_array + rank;
+		output_length = 1;
+		printf("Percentile %g: %d\n", opts.percentile, *output);
+	}
+
+	if (write_file(output, output_length, opts.out_format) != 0)
 	{
 		printf("Error writing to outfile");
 		return -1;
@@ -301,6 +446,9 @@ int main(int argc, char **argv)
 	free(result_array);
 	free(integers);
 
+	if (opts.is_verify && verify_output("outfile.txt", &expected) != 0)
+		return EXIT_FAILURE;
+
 	clock_gettime(CLOCK_MONOTONIC, &(time));
 	long long total_program_worked = (time.tv_sec * 1000000 + time.tv_nsec / 1000) - start_time;
 	printf("Total time: %lld us\n", total_program_worked);
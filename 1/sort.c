@@ -0,0 +1,273 @@
+#include "sort.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "libcoro.h"
+#include "merge_simd.h"
+
+/*н
+Пояснения к сортировке:
+У нас есть предмет "Углубленный C", на котором мы реализовывали вручную mergesort для разных типов данных.
+Компаратор, функции merge и mergesort взяты оттуда.
+*/
+
+int int_gt_comparator(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	/* Subtraction would overflow on far apart numbers. */
+	return (x > y) - (x < y);
+}
+
+#define SORT_NAME int32
+#define SORT_SIZE sizeof(int32_t)
+#define SORT_KEY_TYPE int32_t
+#define SORT_KEY_OFFSET 0
+#define SORT_MERGE_INT32
+#define SORT_YIELD() yield_coro_period_end()
+#include "sort_tmpl.h"
+
+#define SORT_NAME int64
+#define SORT_SIZE sizeof(int64_t)
+#define SORT_KEY_TYPE int64_t
+#define SORT_KEY_OFFSET 0
+#define SORT_YIELD() yield_coro_period_end()
+#include "sort_tmpl.h"
+
+#define SORT_NAME kv32
+#define SORT_SIZE sizeof(struct kv32)
+#define SORT_KEY_TYPE int32_t
+#define SORT_KEY_OFFSET offsetof(struct kv32, key)
+#define SORT_YIELD() yield_coro_period_end()
+#include "sort_tmpl.h"
+
+#define SORT_NAME kv64
+#define SORT_SIZE sizeof(struct kv64)
+#define SORT_KEY_TYPE int64_t
+#define SORT_KEY_OFFSET offsetof(struct kv64, key)
+#define SORT_YIELD() yield_coro_period_end()
+#include "sort_tmpl.h"
+
+/* Fallback for any record with a comparator given at runtime. */
+#define SORT_NAME any
+#define SORT_SIZE element_size
+#define SORT_LESS(a, b) (comparator((a), (b)) < 0)
+#define SORT_EXTRA_PARAMS , size_t element_size, sort_cmp_f comparator
+#define SORT_EXTRA_ARGS , element_size, comparator
+#define SORT_YIELD() yield_coro_period_end()
+#include "sort_tmpl.h"
+
+void merge(
+	void *left_start, void *right_start,
+	size_t left_size, size_t right_size,
+	size_t element_size,
+	int (*comparator)(const void *, const void *),
+	void *result)
+{
+	if (comparator == int_gt_comparator && element_size == sizeof(int))
+	{
+		int32_merge(left_start, left_size, right_start, right_size, result);
+		return;
+	}
+	any_merge(left_start, left_size, right_start, right_size, result,
+		  element_size, comparator);
+}
+
+int mergesort(
+	void *array,
+	size_t elements,
+	size_t element_size,
+	int (*comparator)(const void *, const void *))
+{
+	if (comparator == int_gt_comparator && element_size == sizeof(int))
+	{
+		return int32_sort(array, elements);
+	}
+	return any_sort(array, elements, element_size, comparator);
+}
+
+enum {
+	/** Ranges smaller than that are finished by insertion sort. */
+	SELECT_SMALL_RANGE = 16,
+};
+
+static inline void
+int32_swap(int *a, int *b)
+{
+	int tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+int32_sift_down(int *heap, size_t size, size_t i)
+{
+	while (true) {
+		size_t max = i;
+		size_t l = 2 * i + 1, r = l + 1;
+		if (l < size && heap[l] > heap[max])
+			max = l;
+		if (r < size && heap[r] > heap[max])
+			max = r;
+		if (max == i)
+			return;
+		int32_swap(&heap[i], &heap[max]);
+		i = max;
+	}
+}
+
+/**
+ * Fallback of int32_select() when partitioning degrades. The k + 1
+ * smallest numbers are collected in a max-heap in the array prefix,
+ * its root is the answer.
+ */
+static void
+int32_heap_select(int *array, size_t count, size_t k)
+{
+	size_t heap_size = k + 1;
+	for (size_t i = heap_size / 2; i > 0; i--)
+		int32_sift_down(array, heap_size, i - 1);
+	for (size_t i = heap_size; i < count; i++) {
+		if (array[i] < array[0]) {
+			int32_swap(&array[i], &array[0]);
+			int32_sift_down(array, heap_size, 0);
+		}
+	}
+	int32_swap(&array[0], &array[k]);
+}
+
+void
+int32_select(int *array, size_t count, size_t k)
+{
+	assert(k < count);
+	size_t lo = 0, hi = count;
+	int depth_limit = 0;
+	for (size_t n = count; n > 1; n >>= 1)
+		depth_limit += 2;
+
+	while (hi - lo > SELECT_SMALL_RANGE) {
+		if (depth_limit-- == 0) {
+			int32_heap_select(array + lo, hi - lo, k - lo);
+			return;
+		}
+		/* Median of three as a pivot. */
+		int a = array[lo], b = array[lo + (hi - lo) / 2], c = array[hi - 1];
+		int pivot = a < b ? (b < c ? b : (a < c ? c : a)) :
+			    (a < c ? a : (b < c ? c : b));
+		/*
+		 * Three-way partition: [lo, lt) < pivot, [lt, gt) == pivot,
+		 * [gt, hi) > pivot. Many duplicates then don't hurt.
+		 */
+		size_t lt = lo, gt = hi, i = lo;
+		while (i < gt) {
+			if (array[i] < pivot)
+				int32_swap(&array[lt++], &array[i++]);
+			else if (array[i] > pivot)
+				int32_swap(&array[i], &array[--gt]);
+			else
+				i++;
+		}
+		if (k < lt)
+			hi = lt;
+		else if (k >= gt)
+			lo = gt;
+		else
+			return;
+		yield_coro_period_end();
+	}
+
+	for (size_t i = lo + 1; i < hi; i++) {
+		int v = array[i];
+		size_t j = i;
+		for (; j > lo && array[j - 1] > v; j--)
+			array[j] = array[j - 1];
+		array[j] = v;
+	}
+}
+
+static void
+int32_sift_up(int *heap, size_t i)
+{
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (heap[parent] >= heap[i])
+			return;
+		int32_swap(&heap[parent], &heap[i]);
+		i = parent;
+	}
+}
+
+void
+int32_topk_create(struct int32_topk *t, size_t k, bool is_biggest)
+{
+	t->heap = NULL;
+	t->size = 0;
+	t->capacity = 0;
+	t->k = k;
+	t->is_biggest = is_biggest;
+}
+
+void
+int32_topk_destroy(struct int32_topk *t)
+{
+	free(t->heap);
+	t->heap = NULL;
+	t->size = 0;
+	t->capacity = 0;
+}
+
+int
+int32_topk_push(struct int32_topk *t, const int *numbers, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		int v = t->is_biggest ? ~numbers[i] : numbers[i];
+		if (t->size == t->k) {
+			/* The root is the worst of the kept ones. */
+			if (t->k == 0 || v >= t->heap[0])
+				continue;
+			t->heap[0] = v;
+			int32_sift_down(t->heap, t->size, 0);
+			continue;
+		}
+		if (t->size == t->capacity) {
+			/* Grows by the input, a big K on a small file is fine. */
+			size_t cap = t->capacity == 0 ? 16 : t->capacity * 2;
+			if (cap > t->k)
+				cap = t->k;
+			int *tmp = realloc(t->heap, cap * sizeof(*tmp));
+			if (tmp == NULL)
+				return -1;
+			t->heap = tmp;
+			t->capacity = cap;
+		}
+		t->heap[t->size] = v;
+		int32_sift_up(t->heap, t->size++);
+	}
+	return 0;
+}
+
+int
+int32_topk_finish(struct int32_topk *t, int **numbers, size_t *count)
+{
+	size_t size = t->size;
+	/* malloc(0) can return NULL. */
+	int *res = t->heap != NULL ? t->heap : malloc(sizeof(*res));
+	if (res == NULL || int32_sort(res, size) != 0)
+		return -1;
+	if (t->is_biggest) {
+		/* Ascending ~x is descending x. */
+		for (size_t i = 0, j = size; i < j; ++i, --j) {
+			int tmp = ~res[i];
+			res[i] = ~res[j - 1];
+			res[j - 1] = tmp;
+		}
+	}
+	t->heap = NULL;
+	t->size = 0;
+	t->capacity = 0;
+	*numbers = res;
+	*count = size;
+	return 0;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int (*sort_cmp_f)(const void *, const void *);
+
+/** A record sorted by a 32-bit key, the payload goes along. */
+struct kv32 {
+	int32_t key;
+	int32_t payload;
+};
+
+/** A record sorted by a 64-bit key, the payload goes along. */
+struct kv64 {
+	int64_t key;
+	int64_t payload;
+};
+
+int int_gt_comparator(const void *a, const void *b);
+
+/**
+ * Generic merge of two sorted arrays. Plain ints with
+ * int_gt_comparator go to the specialised code.
+ */
+void merge(
+	void *left_start, void *right_start,
+	size_t left_size, size_t right_size,
+	size_t element_size,
+	int (*comparator)(const void *, const void *),
+	void *result);
+
+/**
+ * Generic stable sort with a runtime comparator. It is a fallback
+ * for the types without a specialised sort below, plain ints with
+ * int_gt_comparator are sorted by int32_sort().
+ */
+int mergesort(
+	void *array,
+	size_t elements,
+	size_t element_size,
+	int (*comparator)(const void *, const void *));
+
+/*
+ * Sorts specialised at compile time by sort_tmpl.h. No indirect
+ * calls, the keys are compared inline. All return 0 on success and
+ * -1 when there is no memory. More of them for other record layouts
+ * can be generated the same way.
+ */
+
+int
+int32_sort(void *array, size_t count);
+
+void
+int32_merge(const void *left, size_t left_size, const void *right,
+	    size_t right_size, void *result);
+
+int
+int64_sort(void *array, size_t count);
+
+void
+int64_merge(const void *left, size_t left_size, const void *right,
+	    size_t right_size, void *result);
+
+/** Sort struct kv32 records by the key. */
+int
+kv32_sort(void *array, size_t count);
+
+void
+kv32_merge(const void *left, size_t left_size, const void *right,
+	   size_t right_size, void *result);
+
+/** Sort struct kv64 records by the key. */
+int
+kv64_sort(void *array, size_t count);
+
+void
+kv64_merge(const void *left, size_t left_size, const void *right,
+	   size_t right_size, void *result);
+
+/**
+ * Partial sort of ints, introselect. After it @a array[@a k] is the
+ * number which would be there after a full sort, all the numbers
+ * before it are <=, all after it are >=. Average O(N), worst case
+ * O(N log N). @a k should be < @a count.
+ */
+void
+int32_select(int *array, size_t count, size_t k);
+
+/**
+ * The K smallest or the K biggest numbers of a stream, kept in a
+ * bounded max-heap. Memory is O(K) whatever count of numbers is
+ * pushed, and a push costs O(log K) at most.
+ */
+struct int32_topk {
+	int *heap;
+	size_t size;
+	size_t capacity;
+	size_t k;
+	/**
+	 * The biggest numbers are kept as ~x. It reverses the order
+	 * like a negation, but doesn't overflow on INT_MIN.
+	 */
+	bool is_biggest;
+};
+
+void
+int32_topk_create(struct int32_topk *t, size_t k, bool is_biggest);
+
+void
+int32_topk_destroy(struct int32_topk *t);
+
+/**
+ * Offer the numbers to the heap.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+int32_topk_push(struct int32_topk *t, const int *numbers, size_t count);
+
+/**
+ * Take the kept numbers sorted ascending. @a numbers is a new array
+ * which has to be freed by the caller, the heap becomes empty.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+int32_topk_finish(struct int32_topk *t, int **numbers, size_t *count);
@@ -0,0 +1,249 @@
+#include "sort.h"
+
+#include "libcoro.h"
+#include "unit.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Tests of the sorts generated by sort_tmpl.h for the types the
+ * sorter itself doesn't use: 64-bit keys and key + payload records.
+ * The sorts yield between merges, so the tests run in a coroutine.
+ *
+ * $> make test
+ * $> ./sort_test
+ */
+
+/** Sizes around the min run length and a few big ones. */
+static const size_t sizes[] = {0, 1, 2, 63, 64, 65, 1000, 100003};
+
+enum {
+	MAX_SIZE = 100003,
+};
+
+static uint64_t rand_state = 1;
+
+/** Deterministic 64-bit generator, rand() gives only 31 bits. */
+static uint64_t
+rand64(void)
+{
+	rand_state = rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	uint64_t x = rand_state;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	return x ^ (x >> 33);
+}
+
+/** Keys of several shapes: random, few unique, with runs, extremes. */
+static int64_t
+gen_key64(size_t i, size_t n, int shape)
+{
+	static const int64_t edges[] = {INT64_MIN, INT64_MIN + 1, -1, 0, 1,
+					INT64_MAX - 1, INT64_MAX};
+	switch (shape) {
+	case 0:
+		return (int64_t)rand64();
+	case 1:
+		return (int64_t)(rand64() % 8);
+	case 2:
+		/* Ascending and descending runs with equal neighbours. */
+		return (int64_t)((i / 100) % 2 == 0 ? i / 3 : n - i / 3);
+	default:
+		return edges[rand64() % (sizeof(edges) / sizeof(edges[0]))];
+	}
+}
+
+enum {
+	SHAPE_COUNT = 4,
+};
+
+static int
+int64_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+test_int64_sort(void)
+{
+	unit_test_start();
+	int64_t *a = malloc(MAX_SIZE * sizeof(*a));
+	int64_t *ref = malloc(MAX_SIZE * sizeof(*ref));
+	bool is_ok = true;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		size_t n = sizes[s];
+		for (int shape = 0; shape < SHAPE_COUNT; ++shape) {
+			for (size_t i = 0; i < n; ++i)
+				a[i] = ref[i] = gen_key64(i, n, shape);
+			qsort(ref, n, sizeof(*ref), int64_cmp);
+			is_ok = is_ok && int64_sort(a, n) == 0 &&
+				(n == 0 || memcmp(a, ref, n * sizeof(*a)) == 0);
+		}
+	}
+	unit_check(is_ok, "int64 sorts like qsort, extreme keys too");
+
+	a[0] = INT64_MAX;
+	a[1] = INT64_MIN;
+	a[2] = 0;
+	unit_check(int64_sort(a, 3) == 0 && a[0] == INT64_MIN && a[1] == 0 &&
+		   a[2] == INT64_MAX, "INT64_MIN and INT64_MAX don't overflow");
+	free(a);
+	free(ref);
+	unit_test_finish();
+}
+
+static void
+test_int64_merge(void)
+{
+	unit_test_start();
+	int64_t l[] = {INT64_MIN, -1, 0, 0, INT64_MAX};
+	int64_t r[] = {INT64_MIN, 0, 1, INT64_MAX, INT64_MAX};
+	int64_t res[10];
+	int64_merge(l, 5, r, 5, res);
+	int64_t expected[] = {INT64_MIN, INT64_MIN, -1, 0, 0, 0, 1,
+			      INT64_MAX, INT64_MAX, INT64_MAX};
+	unit_check(memcmp(res, expected, sizeof(res)) == 0, "merge");
+	int64_merge(l, 5, r, 0, res);
+	unit_check(memcmp(res, l, sizeof(l)) == 0, "merge with empty right");
+	int64_merge(l, 0, r, 5, res);
+	unit_check(memcmp(res, r, sizeof(r)) == 0, "merge with empty left");
+	unit_test_finish();
+}
+
+static void
+test_kv32_sort(void)
+{
+	unit_test_start();
+	struct kv32 *a = malloc(MAX_SIZE * sizeof(*a));
+	bool is_sorted = true, is_stable = true;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		size_t n = sizes[s];
+		for (int shape = 0; shape < SHAPE_COUNT; ++shape) {
+			/* The payload is the position, it tells the order. */
+			for (size_t i = 0; i < n; ++i) {
+				int64_t k = gen_key64(i, n, shape);
+				a[i].key = shape == 3 ? (k < 0 ? INT32_MIN : INT32_MAX) :
+					   (int32_t)k;
+				a[i].payload = (int32_t)i;
+			}
+			if (kv32_sort(a, n) != 0)
+				is_sorted = false;
+			for (size_t i = 1; i < n; ++i) {
+				if (a[i - 1].key > a[i].key)
+					is_sorted = false;
+				else if (a[i - 1].key == a[i].key &&
+					 a[i - 1].payload > a[i].payload)
+					is_stable = false;
+			}
+		}
+	}
+	unit_check(is_sorted, "kv32 sorted by the key");
+	unit_check(is_stable, "payloads of equal keys keep their order");
+	free(a);
+	unit_test_finish();
+}
+
+static void
+test_kv64_sort(void)
+{
+	unit_test_start();
+	struct kv64 *a = malloc(MAX_SIZE * sizeof(*a));
+	bool is_sorted = true, is_stable = true;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		size_t n = sizes[s];
+		for (int shape = 0; shape < SHAPE_COUNT; ++shape) {
+			for (size_t i = 0; i < n; ++i) {
+				a[i].key = gen_key64(i, n, shape);
+				a[i].payload = (int64_t)i;
+			}
+			if (kv64_sort(a, n) != 0)
+				is_sorted = false;
+			for (size_t i = 1; i < n; ++i) {
+				if (a[i - 1].key > a[i].key)
+					is_sorted = false;
+				else if (a[i - 1].key == a[i].key &&
+					 a[i - 1].payload > a[i].payload)
+					is_stable = false;
+			}
+		}
+	}
+	unit_check(is_sorted, "kv64 sorted by the key, extreme keys too");
+	unit_check(is_stable, "payloads of equal keys keep their order");
+	free(a);
+	unit_test_finish();
+}
+
+static void
+test_kv_merge(void)
+{
+	unit_test_start();
+	/* Payload 1 is from the left, 2 from the right. */
+	struct kv32 l32[] = {{INT32_MIN, 1}, {0, 1}, {0, 1}, {INT32_MAX, 1}};
+	struct kv32 r32[] = {{INT32_MIN, 2}, {0, 2}, {INT32_MAX, 2}};
+	struct kv32 res32[7];
+	kv32_merge(l32, 4, r32, 3, res32);
+	struct kv32 expected32[] = {{INT32_MIN, 1}, {INT32_MIN, 2}, {0, 1},
+				    {0, 1}, {0, 2}, {INT32_MAX, 1},
+				    {INT32_MAX, 2}};
+	unit_check(memcmp(res32, expected32, sizeof(res32)) == 0,
+		   "kv32 merge takes the left record first on equal keys");
+
+	struct kv64 l64[] = {{INT64_MIN, 1}, {5, 1}, {INT64_MAX, 1}};
+	struct kv64 r64[] = {{INT64_MIN, 2}, {-5, 2}, {5, 2}, {INT64_MAX, 2}};
+	struct kv64 res64[7];
+	kv64_merge(l64, 3, r64, 4, res64);
+	struct kv64 expected64[] = {{INT64_MIN, 1}, {INT64_MIN, 2}, {-5, 2},
+				    {5, 1}, {5, 2}, {INT64_MAX, 1},
+				    {INT64_MAX, 2}};
+	unit_check(memcmp(res64, expected64, sizeof(res64)) == 0,
+		   "kv64 merge takes the left record first on equal keys");
+
+	/* Long merges go through galloping, it has to be stable too. */
+	enum { HALF = 10000 };
+	struct kv64 *l = malloc(HALF * sizeof(*l));
+	struct kv64 *r = malloc(HALF * sizeof(*r));
+	struct kv64 *res = malloc(2 * HALF * sizeof(*res));
+	for (int i = 0; i < HALF; ++i) {
+		l[i] = (struct kv64){i < HALF / 2 ? i / 100 : HALF, 1};
+		r[i] = (struct kv64){i / 1000, 2};
+	}
+	kv64_merge(l, HALF, r, HALF, res);
+	bool is_ok = true;
+	for (int i = 1; i < 2 * HALF; ++i) {
+		if (res[i - 1].key > res[i].key ||
+		    (res[i - 1].key == res[i].key &&
+		     res[i - 1].payload > res[i].payload))
+			is_ok = false;
+	}
+	unit_check(is_ok, "long kv64 merge is sorted and stable");
+	free(l);
+	free(r);
+	free(res);
+	unit_test_finish();
+}
+
+static int
+test_all(void *arg)
+{
+	(void)arg;
+	test_int64_sort();
+	test_int64_merge();
+	test_kv32_sort();
+	test_kv64_sort();
+	test_kv_merge();
+	return 0;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	coro_new(test_all, NULL);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * Natural merge sort template. It is included with parameters
+ * defined, each inclusion generates a separate family of functions
+ * with all the comparisons and copies inlined:
+ *
+ *     #define SORT_NAME kv64
+ *     #define SORT_SIZE 16
+ *     #define SORT_KEY_TYPE int64_t
+ *     #define SORT_KEY_OFFSET 0
+ *     #include "sort_tmpl.h"
+ *
+ * gives kv64_sort() and kv64_merge(). Parameters:
+ *
+ * - SORT_NAME - prefix of the generated functions;
+ * - SORT_SIZE - record size in bytes;
+ * - SORT_KEY_TYPE, SORT_KEY_OFFSET - type and offset of a key which
+ *   is compared with '<'. Instead of them SORT_LESS(a, b) can be
+ *   defined - an expression telling if record a is less than b;
+ * - SORT_EXTRA_PARAMS, SORT_EXTRA_ARGS - optional additional
+ *   parameters of the generated functions, like a runtime record
+ *   size or a comparator. Parameters start with a comma;
+ * - SORT_MERGE_INT32 - optional, records are plain ints, merge them
+ *   with the vector kernel;
+ * - SORT_YIELD() - optional, called between the merges.
+ *
+ * The array is split into already sorted runs (strictly descending
+ * ones are reversed), too short runs are extended with binary
+ * insertion sort, and the runs are merged in the order given by the
+ * powersort rule. Mostly sorted data has few long runs, so an
+ * already sorted array is done in one pass.
+ */
+
+#ifndef SORT_NAME
+#error "SORT_NAME is not defined"
+#endif
+#ifndef SORT_SIZE
+#error "SORT_SIZE is not defined"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SORT_TMPL_COMMON
+#define SORT_TMPL_COMMON
+
+enum {
+	/** Runs shorter than that are extended by insertion sort. */
+	SORT_MIN_RUN_MAX = 64,
+	/** How many wins in a row switch a merge into galloping. */
+	SORT_MIN_GALLOP = 7,
+	/** Run powers grow along the stack, 64 bits are enough. */
+	SORT_MAX_RUNS = 85,
+};
+
+struct sort_run {
+	size_t base;
+	size_t len;
+	/** Power of the boundary with the next run on the stack. */
+	int power;
+};
+
+/** Minimal run length so as the run count is close to a power of 2. */
+static inline size_t
+sort_min_run(size_t n)
+{
+	size_t r = 0;
+	while (n >= SORT_MIN_RUN_MAX) {
+		r |= n & 1;
+		n >>= 1;
+	}
+	return n + r;
+}
+
+/**
+ * Powersort node power of the boundary between two neighbour runs:
+ * the depth of the boundary in a perfectly balanced merge tree.
+ */
+static inline int
+sort_node_power(size_t base, size_t left_size, size_t right_size, size_t n)
+{
+	int power = 0;
+	size_t a = 2 * base + left_size;
+	size_t b = a + left_size + right_size;
+	while (true) {
+		power++;
+		if (a >= n) {
+			a -= n;
+			b -= n;
+		} else if (b >= n) {
+			break;
+		}
+		a <<= 1;
+		b <<= 1;
+	}
+	return power;
+}
+
+#define SORT_CONCAT_IMPL(a, b) a##_##b
+#define SORT_CONCAT(a, b) SORT_CONCAT_IMPL(a, b)
+
+#endif /* SORT_TMPL_COMMON */
+
+#ifndef SORT_EXTRA_PARAMS
+#define SORT_EXTRA_PARAMS
+#define SORT_EXTRA_ARGS
+#endif
+
+#ifndef SORT_YIELD
+#define SORT_YIELD() do {} while (0)
+#endif
+
+#ifndef SORT_LESS
+#define SORT_LESS(a, b) (SORT_FN(key)(a) < SORT_FN(key)(b))
+#define SORT_NEED_KEY
+#endif
+
+#define SORT_FN(name) SORT_CONCAT(SORT_NAME, name)
+#define SORT_ELEM(base, i) ((char *)(base) + (i) * (SORT_SIZE))
+/** a <= b. */
+#define SORT_LESS_EQ(a, b) (!SORT_LESS(b, a))
+
+#ifdef SORT_NEED_KEY
+static inline SORT_KEY_TYPE
+SORT_FN(key)(const char *record)
+{
+	SORT_KEY_TYPE key;
+	memcpy(&key, record + SORT_KEY_OFFSET, sizeof(key));
+	return key;
+}
+#endif
+
+static void
+SORT_FN(reverse)(char *array, size_t count, char *tmp, size_t size)
+{
+	char *lo = array;
+	char *hi = array + (count - 1) * size;
+	while (lo < hi) {
+		memcpy(tmp, lo, size);
+		memcpy(lo, hi, size);
+		memcpy(hi, tmp, size);
+		lo += size;
+		hi -= size;
+	}
+}
+
+/**
+ * Find the run at the array start. A descending run is reversed. It
+ * has to be strict so as the reversal keeps the sort stable.
+ */
+static size_t
+SORT_FN(count_run)(char *array, size_t count, char *tmp SORT_EXTRA_PARAMS)
+{
+	if (count < 2)
+		return count;
+	size_t n = 2;
+	if (SORT_LESS(SORT_ELEM(array, 1), array)) {
+		while (n < count &&
+		       SORT_LESS(SORT_ELEM(array, n), SORT_ELEM(array, n - 1)))
+			n++;
+		SORT_FN(reverse)(array, n, tmp, SORT_SIZE);
+		return n;
+	}
+	while (n < count &&
+	       SORT_LESS_EQ(SORT_ELEM(array, n - 1), SORT_ELEM(array, n)))
+		n++;
+	return n;
+}
+
+/** Extend the sorted prefix of @a sorted records to the whole array. */
+static void
+SORT_FN(binary_insertion)(char *array, size_t count, size_t sorted,
+			  char *pivot SORT_EXTRA_PARAMS)
+{
+	for (size_t i = sorted; i < count; i++) {
+		memcpy(pivot, SORT_ELEM(array, i), SORT_SIZE);
+		size_t lo = 0, hi = i;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (SORT_LESS(pivot, SORT_ELEM(array, mid)))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		memmove(SORT_ELEM(array, lo + 1), SORT_ELEM(array, lo),
+			(i - lo) * (SORT_SIZE));
+		memcpy(SORT_ELEM(array, lo), pivot, SORT_SIZE);
+	}
+}
+
+/**
+ * Count records of the sorted @a base which are <= @a key (when
+ * @a is_right) or < @a key. The probes go exponentially from the
+ * start, so the cost is logarithmic in the result, not in @a n.
+ */
+static size_t
+SORT_FN(gallop)(const char *key, const char *base, size_t n,
+		bool is_right SORT_EXTRA_PARAMS)
+{
+#define SORT_GALLOP_BEFORE(elem) \
+	(is_right ? SORT_LESS_EQ(elem, key) : SORT_LESS(elem, key))
+	size_t last = 0, ofs = 1;
+	while (ofs <= n && SORT_GALLOP_BEFORE(SORT_ELEM(base, ofs - 1))) {
+		last = ofs;
+		ofs = ofs * 2;
+	}
+	size_t lo = last, hi = ofs - 1 < n ? ofs - 1 : n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (SORT_GALLOP_BEFORE(SORT_ELEM(base, mid)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+#undef SORT_GALLOP_BEFORE
+}
+
+#ifndef SORT_MERGE_INT32
+
+/**
+ * Merge the left run copied into @a left with the right run which
+ * lies in @a dst right after the place of the left one. When one
+ * side keeps winning, switch from one-by-one steps to galloping.
+ */
+static void
+SORT_FN(merge_lo)(char *dst, char *left, size_t left_size, char *right,
+		  size_t right_size SORT_EXTRA_PARAMS)
+{
+	size_t min_gallop = SORT_MIN_GALLOP;
+	while (left_size > 0 && right_size > 0) {
+		size_t left_wins = 0, right_wins = 0;
+		do {
+			if (SORT_LESS(right, left)) {
+				memcpy(dst, right, SORT_SIZE);
+				right += SORT_SIZE;
+				right_size--;
+				right_wins++;
+				left_wins = 0;
+			} else {
+				memcpy(dst, left, SORT_SIZE);
+				left += SORT_SIZE;
+				left_size--;
+				left_wins++;
+				right_wins = 0;
+			}
+			dst += SORT_SIZE;
+		} while (left_size > 0 && right_size > 0 &&
+			 left_wins < min_gallop && right_wins < min_gallop);
+
+		while (left_size > 0 && right_size > 0) {
+			size_t k = SORT_FN(gallop)(right, left, left_size,
+						   true SORT_EXTRA_ARGS);
+			memcpy(dst, left, k * (SORT_SIZE));
+			dst += k * (SORT_SIZE);
+			left += k * (SORT_SIZE);
+			left_size -= k;
+			if (left_size == 0)
+				break;
+			size_t m = SORT_FN(gallop)(left, right, right_size,
+						   false SORT_EXTRA_ARGS);
+			memmove(dst, right, m * (SORT_SIZE));
+			dst += m * (SORT_SIZE);
+			right += m * (SORT_SIZE);
+			right_size -= m;
+			if (k < SORT_MIN_GALLOP && m < SORT_MIN_GALLOP) {
+				/* Galloping doesn't pay off - make it harder to enter. */
+				min_gallop++;
+				break;
+			}
+			if (min_gallop > 1)
+				min_gallop--;
+		}
+	}
+	/* The right leftovers are in place already. */
+	memcpy(dst, left, left_size * (SORT_SIZE));
+}
+
+#endif /* SORT_MERGE_INT32 */
+
+/** Merge two neighbour runs in place using @a tmp as a buffer. */
+static void
+SORT_FN(merge_runs)(char *array, size_t left_size, size_t right_size,
+		    char *tmp SORT_EXTRA_PARAMS)
+{
+	char *left = array;
+	char *right = SORT_ELEM(array, left_size);
+	/* Left records <= the right head are in place already. */
+	size_t k = SORT_FN(gallop)(right, left, left_size, true SORT_EXTRA_ARGS);
+	left += k * (SORT_SIZE);
+	left_size -= k;
+	if (left_size == 0)
+		return;
+	/* As well as right records >= the left tail. */
+	right_size = SORT_FN(gallop)(right - (SORT_SIZE), right, right_size,
+				     false SORT_EXTRA_ARGS);
+	if (right_size == 0)
+		return;
+
+	memcpy(tmp, left, left_size * (SORT_SIZE));
+#ifdef SORT_MERGE_INT32
+	merge_int32((int *)tmp, left_size, (int *)right, right_size,
+		    (int *)left);
+#else
+	SORT_FN(merge_lo)(left, tmp, left_size, right, right_size
+			  SORT_EXTRA_ARGS);
+#endif
+}
+
+/**
+ * Stable sort of @a count records.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+SORT_FN(sort)(void *array, size_t count SORT_EXTRA_PARAMS)
+{
+	if (count <= 1)
+		return 0;
+	char *tmp = malloc(count * (SORT_SIZE));
+	if (tmp == NULL)
+		return -1;
+
+	struct sort_run runs[SORT_MAX_RUNS];
+	int run_count = 0;
+	size_t min_run = sort_min_run(count);
+	size_t pos = 0;
+	while (pos < count) {
+		char *start = SORT_ELEM(array, pos);
+		size_t left = count - pos;
+		size_t len = SORT_FN(count_run)(start, left, tmp SORT_EXTRA_ARGS);
+		if (len < min_run) {
+			size_t forced = min_run < left ? min_run : left;
+			SORT_FN(binary_insertion)(start, forced, len,
+						  tmp SORT_EXTRA_ARGS);
+			len = forced;
+		}
+
+		if (run_count > 0) {
+			struct sort_run *top = &runs[run_count - 1];
+			int power = sort_node_power(top->base, top->len, len,
+						    count);
+			while (run_count > 1 &&
+			       runs[run_count - 2].power > power) {
+				struct sort_run *l = &runs[run_count - 2];
+				struct sort_run *r = &runs[run_count - 1];
+				SORT_FN(merge_runs)(SORT_ELEM(array, l->base),
+						    l->len, r->len,
+						    tmp SORT_EXTRA_ARGS);
+				l->len += r->len;
+				run_count--;
+				SORT_YIELD();
+			}
+			runs[run_count - 1].power = power;
+		}
+		assert(run_count < SORT_MAX_RUNS);
+		runs[run_count].base = pos;
+		runs[run_count].len = len;
+		runs[run_count].power = 0;
+		run_count++;
+		pos += len;
+		SORT_YIELD();
+	}
+
+	while (run_count > 1) {
+		struct sort_run *l = &runs[run_count - 2];
+		struct sort_run *r = &runs[run_count - 1];
+		SORT_FN(merge_runs)(SORT_ELEM(array, l->base), l->len, r->len,
+				    tmp SORT_EXTRA_ARGS);
+		l->len += r->len;
+		run_count--;
+		SORT_YIELD();
+	}
+
+	free(tmp);
+	return 0;
+}
+
+/** Merge two sorted arrays of records into @a result. */
+void
+SORT_FN(merge)(const void *left, size_t left_size, const void *right,
+	       size_t right_size, void *result SORT_EXTRA_PARAMS)
+{
+#ifdef SORT_MERGE_INT32
+	merge_int32(left, left_size, right, right_size, result);
+#else
+	const char *l = left, *r = right;
+	char *out = result;
+	while (left_size > 0 && right_size > 0) {
+		if (SORT_LESS(r, l)) {
+			memcpy(out, r, SORT_SIZE);
+			r += SORT_SIZE;
+			right_size--;
+		} else {
+			memcpy(out, l, SORT_SIZE);
+			l += SORT_SIZE;
+			left_size--;
+		}
+		out += SORT_SIZE;
+	}
+	memcpy(out, l, left_size * (SORT_SIZE));
+	out += left_size * (SORT_SIZE);
+	memcpy(out, r, right_size * (SORT_SIZE));
+#endif
+}
+
+#undef SORT_FN
+#undef SORT_ELEM
+#undef SORT_LESS_EQ
+#undef SORT_LESS
+#undef SORT_NEED_KEY
+#undef SORT_NAME
+#undef SORT_SIZE
+#undef SORT_KEY_TYPE
+#undef SORT_KEY_OFFSET
+#undef SORT_EXTRA_PARAMS
+#undef SORT_EXTRA_ARGS
+#undef SORT_MERGE_INT32
+#undef SORT_YIELD
@@ -0,0 +1,641 @@
+#include "builtin.h"
+#include "parser.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void
+builtin_out_append(struct builtin_out *out, const char *str, size_t len)
+{
+	if (out->capacity - out->size < len) {
+		size_t new_capacity = (out->capacity + 1) * 2;
+		if (new_capacity - out->size < len)
+			new_capacity = out->size + len;
+		out->data = realloc(out->data, new_capacity);
+		out->capacity = new_capacity;
+	}
+	memcpy(out->data + out->size, str, len);
+	out->size += len;
+}
+
+static void
+builtin_out_printf(struct builtin_out *out, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	if (len <= 0)
+		return;
+	if (out->capacity - out->size < (size_t)len + 1) {
+		out->capacity = out->size + len + 1;
+		out->data = realloc(out->data, out->capacity);
+	}
+	va_start(ap, format);
+	vsnprintf(out->data + out->size, len + 1, format, ap);
+	va_end(ap);
+	out->size += len;
+}
+
+void
+builtin_out_destroy(struct builtin_out *out)
+{
+	free(out->data);
+}
+
+static int
+builtin_true(const struct command *cmd, struct builtin_out *out)
+{
+	(void)cmd;
+	(void)out;
+	return 0;
+}
+
+static int
+builtin_false(const struct command *cmd, struct builtin_out *out)
+{
+	(void)cmd;
+	(void)out;
+	return 1;
+}
+
+static int
+builtin_pwd(const struct command *cmd, struct builtin_out *out)
+{
+	(void)cmd;
+	char *cwd = getcwd(NULL, 0);
+	if (cwd == NULL) {
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	builtin_out_append(out, cwd, strlen(cwd));
+	builtin_out_append(out, "\n", 1);
+	free(cwd);
+	return 0;
+}
+
+static int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Decode an escape sequence of printf or echo -e. @a pos points right
+ * after the backslash. In arguments of %b and in echo octal numbers
+ * are written as \0NNN, in a printf format - as \NNN. \c sets
+ * @a is_stop, all the output after it is dropped.
+ * @return Position after the sequence.
+ */
+static const char *
+escape_decode(const char *pos, struct builtin_out *out, bool is_arg,
+	      bool *is_stop)
+{
+	char c = *pos;
+	int value, digits;
+	switch (c) {
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'e': c = '\033'; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case '\\':
+	case '"':
+	case '\'':
+		break;
+	case 'c':
+		*is_stop = true;
+		return pos + 1;
+	case 'x':
+		value = 0;
+		for (digits = 0; digits < 2 && hex_digit(pos[1]) >= 0; ++digits)
+			value = value * 16 + hex_digit(*++pos);
+		if (digits == 0) {
+			builtin_out_append(out, "\\x", 2);
+			return pos + 1;
+		}
+		c = value;
+		break;
+	case '0': case '1': case '2': case '3':
+	case '4': case '5': case '6': case '7':
+		if (is_arg && c != '0') {
+			builtin_out_append(out, "\\", 1);
+			break;
+		}
+		if (is_arg)
+			++pos;
+		value = 0;
+		for (digits = 0; digits < 3 && *pos >= '0' && *pos <= '7'; ++digits)
+			value = value * 8 + *pos++ - '0';
+		c = value;
+		builtin_out_append(out, &c, 1);
+		return pos;
+	case 0:
+		builtin_out_append(out, "\\", 1);
+		return pos;
+	default:
+		builtin_out_append(out, "\\", 1);
+		break;
+	}
+	builtin_out_append(out, &c, 1);
+	return pos + 1;
+}
+
+static void
+escapes_decode(const char *str, struct builtin_out *out, bool *is_stop)
+{
+	while (*str != 0 && !*is_stop) {
+		const char *bs = strchr(str, '\\');
+		if (bs == NULL)
+			bs = str + strlen(str);
+		builtin_out_append(out, str, bs - str);
+		str = bs;
+		if (*str == '\\')
+			str = escape_decode(str + 1, out, true, is_stop);
+	}
+}
+
+static int
+builtin_echo(const struct command *cmd, struct builtin_out *out)
+{
+	bool is_newline = true;
+	bool is_escapes = false;
+	uint32_t i = 0;
+	/* Like in coreutils only -n, -e, -E and their mixes are options. */
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 ||
+		    arg[strspn(arg + 1, "neE") + 1] != 0)
+			break;
+		for (++arg; *arg != 0; ++arg) {
+			if (*arg == 'n')
+				is_newline = false;
+			else
+				is_escapes = *arg == 'e';
+		}
+	}
+	bool is_stop = false;
+	for (uint32_t first = i; i < cmd->arg_count && !is_stop; ++i) {
+		if (i > first)
+			builtin_out_append(out, " ", 1);
+		if (is_escapes)
+			escapes_decode(cmd->args[i], out, &is_stop);
+		else
+			builtin_out_append(out, cmd->args[i], strlen(cmd->args[i]));
+	}
+	if (is_newline && !is_stop)
+		builtin_out_append(out, "\n", 1);
+	return 0;
+}
+
+struct printf_args {
+	char *const *args;
+	uint32_t count;
+	uint32_t pos;
+	int rc;
+};
+
+static const char *
+printf_next_arg(struct printf_args *a)
+{
+	return a->pos < a->count ? a->args[a->pos++] : "";
+}
+
+/** Parse a numeric argument. 'c and "c give the character code. */
+static long long
+printf_number_arg(struct printf_args *a, bool is_unsigned)
+{
+	const char *arg = printf_next_arg(a);
+	if (arg[0] == '\'' || arg[0] == '"')
+		return (unsigned char)arg[1];
+	if (arg[0] == 0)
+		return 0;
+	char *end;
+	errno = 0;
+	long long res;
+	if (is_unsigned && arg[0] != '-')
+		res = strtoull(arg, &end, 0);
+	else
+		res = strtoll(arg, &end, 0);
+	if (*end != 0 || end == arg || errno != 0) {
+		fprintf(stderr, "printf: %s: invalid number\n", arg);
+		a->rc = 1;
+	}
+	return res;
+}
+
+/**
+ * Print one conversion. @a pos points right after the %.
+ * @return Position after the conversion, NULL if it is invalid.
+ */
+static const char *
+printf_conversion(const char *pos, struct printf_args *a,
+		  struct builtin_out *out, bool *is_stop)
+{
+	/* Flags, width and precision are passed to snprintf as is. */
+	char spec[128] = "%";
+	size_t len = 1;
+	const char *begin = pos;
+	pos += strspn(pos, "-+ #0");
+	int width = -1, precision = -1;
+	if (*pos == '*') {
+		width = printf_number_arg(a, false);
+		++pos;
+	} else {
+		pos += strspn(pos, "0123456789");
+	}
+	const char *prec_begin = NULL;
+	if (*pos == '.') {
+		prec_begin = pos;
+		if (*++pos == '*') {
+			precision = printf_number_arg(a, false);
+			++pos;
+		} else {
+			pos += strspn(pos, "0123456789");
+		}
+	}
+	if ((size_t)(pos - begin) + 32 > sizeof(spec))
+		return NULL;
+	/* Copy the flags and the literal width and precision. */
+	for (const char *p = begin; p < pos; ++p) {
+		if (*p == '*')
+			len += sprintf(spec + len, "%d",
+				       p < prec_begin || prec_begin == NULL ?
+				       width : precision);
+		else
+			spec[len++] = *p;
+	}
+	char conv = *pos;
+	switch (conv) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X': {
+		long long value = printf_number_arg(a, conv != 'd' && conv != 'i');
+		spec[len++] = 'l';
+		spec[len++] = 'l';
+		spec[len++] = conv;
+		spec[len] = 0;
+		builtin_out_printf(out, spec, value);
+		break;
+	}
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A': {
+		const char *arg = printf_next_arg(a);
+		char *end;
+		double value = strtod(arg, &end);
+		if (*end != 0) {
+			fprintf(stderr, "printf: %s: invalid number\n", arg);
+			a->rc = 1;
+		}
+		spec[len++] = conv;
+		spec[len] = 0;
+		builtin_out_printf(out, spec, value);
+		break;
+	}
+	case 'c': {
+		const char *arg = printf_next_arg(a);
+		spec[len++] = 'c';
+		spec[len] = 0;
+		if (arg[0] != 0)
+			builtin_out_printf(out, spec, arg[0]);
+		break;
+	}
+	case 's':
+		spec[len++] = 's';
+		spec[len] = 0;
+		builtin_out_printf(out, spec, printf_next_arg(a));
+		break;
+	case 'b': {
+		struct builtin_out str = {0};
+		escapes_decode(printf_next_arg(a), &str, is_stop);
+		builtin_out_append(&str, "", 1);
+		spec[len++] = 's';
+		spec[len] = 0;
+		builtin_out_printf(out, spec, str.data);
+		builtin_out_destroy(&str);
+		break;
+	}
+	case '%':
+		if (pos != begin)
+			return NULL;
+		builtin_out_append(out, "%", 1);
+		break;
+	default:
+		return NULL;
+	}
+	return pos + 1;
+}
+
+static int
+builtin_printf(const struct command *cmd, struct builtin_out *out)
+{
+	if (cmd->arg_count == 0) {
+		fprintf(stderr, "printf: missing operand\n");
+		return 1;
+	}
+	const char *format = cmd->args[0];
+	struct printf_args a = {
+		.args = cmd->args + 1,
+		.count = cmd->arg_count - 1,
+	};
+	bool is_stop = false;
+	/* The format is reused while there are arguments left. */
+	do {
+		uint32_t first = a.pos;
+		const char *pos = format;
+		while (*pos != 0 && !is_stop) {
+			if (*pos == '\\') {
+				pos = escape_decode(pos + 1, out, false, &is_stop);
+				continue;
+			}
+			if (*pos == '%') {
+				const char *next = printf_conversion(pos + 1, &a, out,
+								     &is_stop);
+				if (next == NULL) {
+					fprintf(stderr, "printf: %s: invalid "
+						"conversion\n", pos);
+					return 1;
+				}
+				pos = next;
+				continue;
+			}
+			size_t run = strcspn(pos, "\\%");
+			builtin_out_append(out, pos, run);
+			pos += run;
+		}
+		if (a.pos == first)
+			break;
+	} while (a.pos < a.count && !is_stop);
+	return a.rc;
+}
+
+struct test_parser {
+	char *const *args;
+	uint32_t count;
+	uint32_t pos;
+	bool is_error;
+	/** The error is printed already. */
+	bool is_reported;
+};
+
+static bool
+test_or(struct test_parser *t);
+
+static bool
+test_integer(struct test_parser *t, const char *str, long long *out)
+{
+	char *end;
+	errno = 0;
+	*out = strtoll(str, &end, 10);
+	if (end == str || *end != 0 || errno != 0) {
+		fprintf(stderr, "test: %s: integer expression expected\n", str);
+		t->is_error = true;
+		t->is_reported = true;
+		return false;
+	}
+	return true;
+}
+
+static bool
+test_is_unary(const char *op)
+{
+	return op[0] == '-' && op[1] != 0 && op[2] == 0 &&
+	       strchr("nzefdrwxsLhpSbct", op[1]) != NULL;
+}
+
+static bool
+test_unary(struct test_parser *t, char op, const char *arg)
+{
+	struct stat st;
+	switch (op) {
+	case 'n':
+		return arg[0] != 0;
+	case 'z':
+		return arg[0] == 0;
+	case 'r':
+		return access(arg, R_OK) == 0;
+	case 'w':
+		return access(arg, W_OK) == 0;
+	case 'x':
+		return access(arg, X_OK) == 0;
+	case 't': {
+		long long fd;
+		return test_integer(t, arg, &fd) && isatty(fd);
+	}
+	case 'L':
+	case 'h':
+		return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+	default:
+		break;
+	}
+	if (stat(arg, &st) != 0)
+		return false;
+	switch (op) {
+	case 'e':
+		return true;
+	case 'f':
+		return S_ISREG(st.st_mode);
+	case 'd':
+		return S_ISDIR(st.st_mode);
+	case 's':
+		return st.st_size > 0;
+	case 'p':
+		return S_ISFIFO(st.st_mode);
+	case 'S':
+		return S_ISSOCK(st.st_mode);
+	case 'b':
+		return S_ISBLK(st.st_mode);
+	case 'c':
+		return S_ISCHR(st.st_mode);
+	default:
+		assert(false);
+		return false;
+	}
+}
+
+/**
+ * Evaluate a binary operator.
+ * @retval -1 Not a binary operator.
+ */
+static int
+test_binary(struct test_parser *t, const char *a, const char *op, const char *b)
+{
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+		return strcmp(a, b) == 0;
+	if (strcmp(op, "!=") == 0)
+		return strcmp(a, b) != 0;
+	if (strcmp(op, "<") == 0)
+		return strcmp(a, b) < 0;
+	if (strcmp(op, ">") == 0)
+		return strcmp(a, b) > 0;
+	static const char *const int_ops[] = {
+		"-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+	};
+	int i = 0;
+	while (i < 6 && strcmp(op, int_ops[i]) != 0)
+		++i;
+	if (i == 6)
+		return -1;
+	long long x, y;
+	if (!test_integer(t, a, &x) || !test_integer(t, b, &y))
+		return 0;
+	switch (i) {
+	case 0: return x == y;
+	case 1: return x != y;
+	case 2: return x < y;
+	case 3: return x <= y;
+	case 4: return x > y;
+	default: return x >= y;
+	}
+}
+
+static bool
+test_primary(struct test_parser *t)
+{
+	if (t->pos >= t->count) {
+		t->is_error = true;
+		return false;
+	}
+	char *const *args = t->args + t->pos;
+	uint32_t left = t->count - t->pos;
+	if (left >= 3) {
+		int res = test_binary(t, args[0], args[1], args[2]);
+		if (res >= 0) {
+			t->pos += 3;
+			return res;
+		}
+	}
+	if (strcmp(args[0], "(") == 0 && left >= 2) {
+		t->pos++;
+		bool res = test_or(t);
+		if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+			t->is_error = true;
+			return false;
+		}
+		t->pos++;
+		return res;
+	}
+	if (left >= 2 && test_is_unary(args[0])) {
+		t->pos += 2;
+		return test_unary(t, args[0][1], args[1]);
+	}
+	t->pos++;
+	return args[0][0] != 0;
+}
+
+static bool
+test_not(struct test_parser *t)
+{
+	if (t->pos + 1 < t->count && strcmp(t->args[t->pos], "!") == 0) {
+		t->pos++;
+		return !test_not(t);
+	}
+	return test_primary(t);
+}
+
+static bool
+test_and(struct test_parser *t)
+{
+	bool res = test_not(t);
+	while (t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+		t->pos++;
+		res = test_not(t) && res;
+	}
+	return res;
+}
+
+static bool
+test_or(struct test_parser *t)
+{
+	bool res = test_and(t);
+	while (t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+		t->pos++;
+		res = test_and(t) || res;
+	}
+	return res;
+}
+
+static int
+test_run(const char *name, char *const *args, uint32_t count)
+{
+	if (count == 0)
+		return 1;
+	struct test_parser t = {
+		.args = args,
+		.count = count,
+	};
+	bool res = test_or(&t);
+	if (t.is_error || t.pos != t.count) {
+		if (!t.is_reported)
+			fprintf(stderr, "%s: syntax error\n", name);
+		return 2;
+	}
+	return res ? 0 : 1;
+}
+
+static int
+builtin_test(const struct command *cmd, struct builtin_out *out)
+{
+	(void)out;
+	return test_run("test", cmd->args, cmd->arg_count);
+}
+
+static int
+builtin_bracket(const struct command *cmd, struct builtin_out *out)
+{
+	(void)out;
+	if (cmd->arg_count == 0 ||
+	    strcmp(cmd->args[cmd->arg_count - 1], "]") != 0) {
+		fprintf(stderr, "[: missing ]\n");
+		return 2;
+	}
+	return test_run("[", cmd->args, cmd->arg_count - 1);
+}
+
+static const struct {
+	const char *name;
+	builtin_f func;
+} builtins[] = {
+	{"echo", builtin_echo},
+	{"true", builtin_true},
+	{"false", builtin_false},
+	{"printf", builtin_printf},
+	{"test", builtin_test},
+	{"[", builtin_bracket},
+	{"pwd", builtin_pwd},
+};
+
+builtin_f
+builtin_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+		if (strcmp(builtins[i].name, name) == 0)
+			return builtins[i].func;
+	}
+	return NULL;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+struct command;
+
+/**
+ * Output of a builtin. Builtins run inside the shell, so they don't
+ * write to a file descriptor directly - the output is collected here
+ * and then the shell sends it to stdout, a file or a pipe.
+ */
+struct builtin_out {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+void
+builtin_out_append(struct builtin_out *out, const char *str, size_t len);
+
+void
+builtin_out_destroy(struct builtin_out *out);
+
+/**
+ * A builtin command. Returns the exit status, errors are printed to
+ * stderr.
+ */
+typedef int (*builtin_f)(const struct command *cmd, struct builtin_out *out);
+
+/**
+ * Find a builtin which can replace an external command: echo, true,
+ * false, printf, test, [ and pwd.
+ * @retval NULL No such builtin.
+ */
+builtin_f
+builtin_find(const char *name);
@@ -62,6 +62,7 @@ tests = [
 	"f.close()\\n\" > test.py",
 "python3 test.py | exit 0",
 "cat test.txt",
+"printf \"%0200000d\" 0 | head -c 10 | wc -c | tr -d [:blank:]",
 ],
 [
 "false && echo 123",
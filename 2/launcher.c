@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include "launcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+enum {
+	/** Max size of a request: the path and argv. */
+	LAUNCHER_MSG_MAX = 64 * 1024,
+	/** Stdin, stdout, stderr and the working directory. */
+	LAUNCHER_FD_COUNT = 4,
+	LAUNCHER_ARG_MAX = LAUNCHER_MSG_MAX / 2,
+};
+
+struct launcher {
+	pid_t pid;
+	/** Requests and their replies. */
+	int req_fd;
+	/** Exit reports. */
+	int event_fd;
+	/** O_PATH descriptor of the shell's working directory. */
+	int cwd_fd;
+};
+
+struct launcher_reply {
+	/** 0 or errno. */
+	int error;
+	pid_t pid;
+};
+
+struct launcher_exit {
+	pid_t pid;
+	int status;
+	struct rusage usage;
+};
+
+/**
+ * Request layout: uint32_t argc, then the path and the arguments, each
+ * zero-terminated.
+ */
+static size_t
+launcher_pack(char *buf, const char *path, char *const argv[])
+{
+	uint32_t argc = 0;
+	while (argv[argc] != NULL)
+		++argc;
+	if (argc >= LAUNCHER_ARG_MAX)
+		return 0;
+	memcpy(buf, &argc, sizeof(argc));
+	size_t size = sizeof(argc);
+	for (uint32_t i = 0; i <= argc; ++i) {
+		const char *str = i == 0 ? path : argv[i - 1];
+		size_t len = strlen(str) + 1;
+		if (LAUNCHER_MSG_MAX - size < len)
+			return 0;
+		memcpy(buf + size, str, len);
+		size += len;
+	}
+	return size;
+}
+
+/**
+ * Unpack a request in place.
+ * @retval The path, NULL if the request is malformed.
+ */
+static const char *
+launcher_unpack(char *buf, size_t size, char **argv)
+{
+	uint32_t argc;
+	if (size < sizeof(argc) || buf[size - 1] != 0)
+		return NULL;
+	memcpy(&argc, buf, sizeof(argc));
+	if (argc >= LAUNCHER_ARG_MAX)
+		return NULL;
+	char *pos = buf + sizeof(argc);
+	char *end = buf + size;
+	const char *path = pos;
+	pos += strlen(pos) + 1;
+	for (uint32_t i = 0; i < argc; ++i) {
+		if (pos >= end)
+			return NULL;
+		argv[i] = pos;
+		pos += strlen(pos) + 1;
+	}
+	argv[argc] = NULL;
+	return path;
+}
+
+/** Receive a request with its descriptors. */
+static ssize_t
+launcher_recv(int sock, char *buf, int *fds)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_FD_COUNT)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {.iov_base = buf, .iov_len = LAUNCHER_MSG_MAX};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t rc;
+	do {
+		rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0)
+		return -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int) * LAUNCHER_FD_COUNT)) {
+		/* Only a broken shell sends it, nothing to spawn. */
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * LAUNCHER_FD_COUNT);
+	return rc;
+}
+
+static void
+launcher_serve(int req_fd, const posix_spawnattr_t *attr)
+{
+	static char buf[LAUNCHER_MSG_MAX];
+	static char *argv[LAUNCHER_ARG_MAX + 1];
+	int fds[LAUNCHER_FD_COUNT];
+	ssize_t size = launcher_recv(req_fd, buf, fds);
+	if (size < 0)
+		_exit(0);
+	struct launcher_reply reply = {.error = EINVAL};
+	const char *path = size > 0 ? launcher_unpack(buf, size, argv) : NULL;
+	if (path != NULL) {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		for (int i = 0; i < 3; ++i)
+			posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+		/* The launcher itself follows the shell's directory. */
+		if (fchdir(fds[3]) != 0)
+			reply.error = errno;
+		else
+			reply.error = posix_spawn(&reply.pid, path, &actions, attr,
+						  argv, environ);
+		posix_spawn_file_actions_destroy(&actions);
+	}
+	if (size > 0) {
+		for (int i = 0; i < LAUNCHER_FD_COUNT; ++i)
+			close(fds[i]);
+	}
+	send(req_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+/**
+ * Exit reports not sent yet. The shell can be blocked on a spawn reply
+ * while many children exit, so the reports are never sent blocking.
+ */
+struct launcher_queue {
+	struct launcher_exit *items;
+	size_t begin;
+	size_t end;
+	size_t capacity;
+};
+
+static void
+launcher_queue_flush(struct launcher_queue *q, int event_fd)
+{
+	while (q->begin < q->end) {
+		ssize_t rc = send(event_fd, &q->items[q->begin],
+				  sizeof(q->items[0]),
+				  MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			/* The shell is gone. */
+			_exit(0);
+		}
+		q->begin++;
+	}
+	q->begin = 0;
+	q->end = 0;
+}
+
+static void
+launcher_reap(struct launcher_queue *q)
+{
+	struct launcher_exit e;
+	while ((e.pid = wait4(-1, &e.status, WNOHANG, &e.usage)) > 0) {
+		if (q->end == q->capacity) {
+			q->capacity = q->capacity == 0 ? 64 : q->capacity * 2;
+			q->items = realloc(q->items,
+					   q->capacity * sizeof(q->items[0]));
+		}
+		q->items[q->end++] = e;
+	}
+}
+
+static void
+launcher_main(int req_fd, int event_fd)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sig_fd < 0) {
+		perror("signalfd");
+		_exit(EXIT_FAILURE);
+	}
+	/* The commands get the usual empty mask. */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t empty;
+	sigemptyset(&empty);
+	posix_spawnattr_setsigmask(&attr, &empty);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	struct launcher_queue queue = {0};
+	struct pollfd pfds[3] = {
+		{.fd = req_fd, .events = POLLIN},
+		{.fd = sig_fd, .events = POLLIN},
+		{.fd = event_fd, .events = POLLOUT},
+	};
+	while (true) {
+		int count = queue.begin < queue.end ? 3 : 2;
+		if (poll(pfds, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+		if (pfds[1].revents != 0) {
+			struct signalfd_siginfo info;
+			while (read(sig_fd, &info, sizeof(info)) > 0) {
+			}
+			launcher_reap(&queue);
+		}
+		launcher_queue_flush(&queue, event_fd);
+		if (pfds[0].revents != 0)
+			launcher_serve(req_fd, &attr);
+	}
+}
+
+struct launcher *
+launcher_new(void)
+{
+	int req[2];
+	int event[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, req) != 0) {
+		perror("socketpair");
+		return NULL;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, event) != 0) {
+		perror("socketpair");
+		close(req[0]);
+		close(req[1]);
+		return NULL;
+	}
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(req[0]);
+		close(event[0]);
+		launcher_main(req[1], event[1]);
+	}
+	close(req[1]);
+	close(event[1]);
+	if (pid < 0) {
+		perror("fork");
+		close(req[0]);
+		close(event[0]);
+		return NULL;
+	}
+	fcntl(event[0], F_SETFL, O_NONBLOCK);
+	struct launcher *l = malloc(sizeof(*l));
+	l->pid = pid;
+	l->req_fd = req[0];
+	l->event_fd = event[0];
+	l->cwd_fd = -1;
+	launcher_update_cwd(l);
+	return l;
+}
+
+void
+launcher_delete(struct launcher *l)
+{
+	/* The launcher exits on the closed socket. */
+	close(l->req_fd);
+	close(l->event_fd);
+	if (l->cwd_fd >= 0)
+		close(l->cwd_fd);
+	waitpid(l->pid, NULL, 0);
+	free(l);
+}
+
+int
+launcher_event_fd(const struct launcher *l)
+{
+	return l->event_fd;
+}
+
+void
+launcher_update_cwd(struct launcher *l)
+{
+	int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (l->cwd_fd >= 0)
+		close(l->cwd_fd);
+	l->cwd_fd = fd;
+}
+
+int
+launcher_spawn(struct launcher *l, const char *path, char *const argv[],
+	       const int fds[3], pid_t *pid)
+{
+	static char buf[LAUNCHER_MSG_MAX];
+	size_t size = launcher_pack(buf, path, argv);
+	if (size == 0)
+		return E2BIG;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_FD_COUNT)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {.iov_base = buf, .iov_len = size};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * LAUNCHER_FD_COUNT);
+	int all_fds[LAUNCHER_FD_COUNT] = {fds[0], fds[1], fds[2], l->cwd_fd};
+	memcpy(CMSG_DATA(cmsg), all_fds, sizeof(all_fds));
+
+	ssize_t rc;
+	do {
+		rc = sendmsg(l->req_fd, &msg, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return errno;
+	struct launcher_reply reply;
+	do {
+		rc = recv(l->req_fd, &reply, sizeof(reply), 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc != sizeof(reply))
+		return rc < 0 ? errno : EPIPE;
+	if (reply.error == 0)
+		*pid = reply.pid;
+	return reply.error;
+}
+
+int
+launcher_next_exit(struct launcher *l, pid_t *pid, int *status,
+		   struct rusage *usage)
+{
+	struct launcher_exit e;
+	ssize_t rc = recv(l->event_fd, &e, sizeof(e), 0);
+	if (rc != sizeof(e))
+		return -1;
+	*pid = e.pid;
+	*status = e.status;
+	*usage = e.usage;
+	return 0;
+}
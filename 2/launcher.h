@@ -0,0 +1,55 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/**
+ * A pre-forked launcher process. It is forked at the shell start while
+ * the shell is still small, and then starts the commands on request.
+ * The path, argv and the stdio descriptors of a command come over a
+ * unix socket, the descriptors as SCM_RIGHTS. The commands are the
+ * launcher's children, so it reaps them and reports their exits over
+ * a second socket, which the shell watches in its event loop.
+ */
+struct launcher;
+
+/**
+ * Fork the launcher.
+ * @retval NULL Error, it is printed.
+ */
+struct launcher *
+launcher_new(void);
+
+/** Stop the launcher. Its running children are not waited for. */
+void
+launcher_delete(struct launcher *l);
+
+/** Becomes readable when there are exit reports. */
+int
+launcher_event_fd(const struct launcher *l);
+
+/**
+ * Follow the shell's working directory after cd. The commands are
+ * started in it.
+ */
+void
+launcher_update_cwd(struct launcher *l);
+
+/**
+ * Start a command. @a fds are its stdin, stdout and stderr.
+ * @retval 0 Success, @a pid is set.
+ * @retval Other - errno of the start.
+ */
+int
+launcher_spawn(struct launcher *l, const char *path, char *const argv[],
+	       const int fds[3], pid_t *pid);
+
+/**
+ * Take the next exit report of a started command. @a status is as
+ * given by wait().
+ * @retval 0 A report is taken.
+ * @retval -1 No more reports now.
+ */
+int
+launcher_next_exit(struct launcher *l, pid_t *pid, int *status,
+		   struct rusage *usage);
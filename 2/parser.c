@@ -5,12 +5,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
-
 enum token_type {
 	TOKEN_TYPE_NONE,
 	TOKEN_TYPE_STR,
@@ -21,84 +15,475 @@ enum token_type {
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
 	TOKEN_TYPE_BACKGROUND,
+	TOKEN_TYPE_IN,
+	TOKEN_TYPE_ERR_NEW,
+	TOKEN_TYPE_ERR_APPEND,
+	TOKEN_TYPE_ERR_TO_OUT,
+	/** 2>& not followed by 1. */
+	TOKEN_TYPE_ERR_BAD,
 };
 
+/**
+ * Where the tokenizer stopped. A token can be cut by the end of the
+ * fed data anywhere, then the tokenizer continues from the same state
+ * on the next feed without rescanning the token from its start.
+ */
+enum token_state {
+	/** Skip spaces before a token. */
+	TOKEN_STATE_START,
+	/** Collect a string into the token data. */
+	TOKEN_STATE_STR,
+	/** After a backslash in a string. */
+	TOKEN_STATE_ESCAPE,
+	/**
+	 * After &, | or >, each of which can be doubled. Or after 2>,
+	 * which can go on as 2>> or 2>&1.
+	 */
+	TOKEN_STATE_OPERATOR,
+	TOKEN_STATE_COMMENT,
+};
+
+/**
+ * A string token is either a slice of the parser buffer, when it is
+ * a plain word, or is collected into own data when it has quotes or
+ * escapes to remove, or was cut by the end of the input.
+ */
 struct token {
 	enum token_type type;
+	/** Slice of the input. NULL if the token is in @a data. */
+	const char *str;
+	uint32_t len;
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
+	enum token_state state;
+	/** Opened quote in the string state. */
+	char quote;
+	/**
+	 * The word has a quote or an escape, so it is not a bare 2
+	 * even if it reads as one.
+	 */
+	bool is_quoted;
+	/**
+	 * The first character of an operator. '2' after 2>, '1' after
+	 * 2>&.
+	 */
+	char op;
 };
 
-static char *
-token_strdup(const struct token *t)
+/** What is expected next in the line being built. */
+enum line_state {
+	/** Commands and operators between them. */
+	LINE_STATE_EXPRS,
+	/** A file name after > or >>. */
+	LINE_STATE_OUT_FILE,
+	/** Only & or the line end after the file name. */
+	LINE_STATE_AFTER_OUT,
+	/** A file name after <. */
+	LINE_STATE_IN_FILE,
+	/** A file name after 2> or 2>>. */
+	LINE_STATE_ERR_FILE,
+	/** Only the line end after &. */
+	LINE_STATE_AFTER_BACKGROUND,
+	/** The line is bad, skip it up to the end. */
+	LINE_STATE_SKIP,
+};
+
+/** No string in a string offset field. */
+#define LINE_STR_NONE UINT32_MAX
+
+/** Expression of a line being built. Strings are offsets in strs. */
+struct expr_draft {
+	enum expr_type type;
+	uint32_t exe;
+	/** Arguments are args[first_arg, first_arg + arg_count). */
+	uint32_t first_arg;
+	uint32_t arg_count;
+	uint32_t in_file;
+	enum stderr_type err_type;
+	uint32_t err_file;
+};
+
+/**
+ * Parts of the line being built. The buffers are reused by all the
+ * lines, so building a line allocates nothing in a steady state. A
+ * finished line is copied from here into a single memory block.
+ */
+struct line_builder {
+	struct expr_draft *exprs;
+	uint32_t expr_count;
+	uint32_t expr_capacity;
+	/** String offsets of all the arguments of all the commands. */
+	uint32_t *args;
+	uint32_t arg_count;
+	uint32_t arg_capacity;
+	/** All the strings of the line, zero-terminated. */
+	char *strs;
+	uint32_t strs_size;
+	uint32_t strs_capacity;
+	enum output_type out_type;
+	uint32_t out_file;
+	bool is_background;
+};
+
+struct parser {
+	char *buffer;
+	/**
+	 * Data of parser_feed_static(), parsed in place of the buffer
+	 * until it is consumed or more data is fed.
+	 */
+	const char *static_data;
+	/**
+	 * Start of the not consumed data. The consumed head is dropped
+	 * lazily, only when a feed has no space for new data.
+	 */
+	uint32_t pos;
+	uint32_t size;
+	uint32_t capacity;
+	/** The line being built. Kept between feeds until it ends. */
+	struct line_builder line;
+	enum line_state line_state;
+	/** The state to return to after a 2> file name. */
+	enum line_state after_err_file;
+	/** Error found in the current line, reported at its end. */
+	enum parser_error error;
+	struct token token;
+};
+
+/** Characters which end or change an unquoted word. */
+static const bool char_is_special[256] = {
+	['\''] = true, ['"'] = true, ['\\'] = true, ['&'] = true,
+	['|'] = true, ['>'] = true, ['<'] = true, ['#'] = true, [' '] = true,
+	['\t'] = true, ['\r'] = true, ['\n'] = true,
+};
+
+/**
+ * Make sure an array has space for @a need more items after @a count.
+ * The capacity at least doubles to keep appends amortized O(1).
+ */
+static void *
+array_reserve(void *data, uint32_t *capacity, uint32_t count, uint32_t need,
+	      size_t item_size)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	if (*capacity - count >= need)
+		return data;
+	uint32_t new_capacity = (*capacity + 1) * 2;
+	if (new_capacity - count < need)
+		new_capacity = count + need;
+	*capacity = new_capacity;
+	return realloc(data, item_size * new_capacity);
 }
 
 static void
-token_append(struct token *t, char c)
+token_append(struct token *t, const char *str, uint32_t len)
 {
-	if (t->size == t->capacity) {
+	if (len == 0)
+		return;
+	if (t->capacity - t->size < len) {
 		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity - t->size < len)
+			t->capacity = t->size + len;
 		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
 	}
-	t->data[t->size++] = c;
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
 }
 
 static void
 token_reset(struct token *t)
 {
 	t->size = 0;
+	t->str = NULL;
+	t->len = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->state = TOKEN_STATE_START;
+	t->quote = 0;
+	t->is_quoted = false;
+}
+
+/**
+ * Find the end of a run of characters which have no special meaning
+ * in the current quote mode, so they can be taken all at once.
+ */
+static const char *
+token_scan_run(const char *pos, const char *end, char quote)
+{
+	if (quote == '\'') {
+		const char *found = memchr(pos, '\'', end - pos);
+		return found != NULL ? found : end;
+	}
+	if (quote == '"') {
+		while (pos < end && *pos != '"' && *pos != '\\')
+			++pos;
+		return pos;
+	}
+	while (pos < end && !char_is_special[(unsigned char)*pos])
+		++pos;
+	return pos;
+}
+
+/** Copy a string token into the line. Returns its offset. */
+static uint32_t
+line_builder_add_str(struct line_builder *b, const struct token *t)
+{
+	assert(t->type == TOKEN_TYPE_STR);
+	const char *str = t->str != NULL ? t->str : t->data;
+	uint32_t len = t->str != NULL ? t->len : t->size;
+	b->strs = array_reserve(b->strs, &b->strs_capacity, b->strs_size,
+				len + 1, sizeof(*b->strs));
+	uint32_t res = b->strs_size;
+	/* An empty quoted string has no data. */
+	if (len > 0)
+		memcpy(b->strs + res, str, len);
+	b->strs[res + len] = 0;
+	b->strs_size += len + 1;
+	return res;
+}
+
+static struct expr_draft *
+line_builder_tail(struct line_builder *b)
+{
+	return b->expr_count > 0 ? &b->exprs[b->expr_count - 1] : NULL;
+}
+
+static struct expr_draft *
+line_builder_append(struct line_builder *b, enum expr_type type)
+{
+	b->exprs = array_reserve(b->exprs, &b->expr_capacity, b->expr_count,
+				 1, sizeof(*b->exprs));
+	struct expr_draft *e = &b->exprs[b->expr_count++];
+	e->type = type;
+	e->exe = 0;
+	e->first_arg = b->arg_count;
+	e->arg_count = 0;
+	e->in_file = LINE_STR_NONE;
+	e->err_type = STDERR_TYPE_DEFAULT;
+	e->err_file = LINE_STR_NONE;
+	return e;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+line_builder_append_arg(struct line_builder *b, const struct token *t)
 {
-	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
-	} else {
-		assert(cmd->arg_count < cmd->arg_capacity);
+	struct expr_draft *e = line_builder_tail(b);
+	assert(e != NULL && e->type == EXPR_TYPE_COMMAND);
+	/* Arguments of a command always go right after each other. */
+	assert(e->first_arg + e->arg_count == b->arg_count);
+	uint32_t str = line_builder_add_str(b, t);
+	b->args = array_reserve(b->args, &b->arg_capacity, b->arg_count, 1,
+				sizeof(*b->args));
+	b->args[b->arg_count++] = str;
+	e->arg_count++;
+}
+
+static void
+line_builder_reset(struct line_builder *b)
+{
+	b->expr_count = 0;
+	b->arg_count = 0;
+	b->strs_size = 0;
+	b->out_type = OUTPUT_TYPE_STDOUT;
+	b->is_background = false;
+}
+
+/**
+ * Build the final line in one memory block laid out as
+ *
+ *     struct command_line;
+ *     struct expr exprs[expr_count];
+ *     char *args[arg_count];
+ *     char strs[strs_size];
+ *
+ * so it takes one allocation and is freed by one free().
+ */
+static struct command_line *
+line_builder_finish(struct line_builder *b)
+{
+	assert(b->expr_count > 0);
+	size_t size = sizeof(struct command_line) +
+		      sizeof(struct expr) * b->expr_count +
+		      sizeof(char *) * b->arg_count + b->strs_size;
+	struct command_line *line = malloc(size);
+	struct expr *exprs = (struct expr *)(line + 1);
+	char **args = (char **)(exprs + b->expr_count);
+	char *strs = (char *)(args + b->arg_count);
+	memcpy(strs, b->strs, b->strs_size);
+	for (uint32_t i = 0; i < b->arg_count; ++i)
+		args[i] = strs + b->args[i];
+	for (uint32_t i = 0; i < b->expr_count; ++i) {
+		const struct expr_draft *d = &b->exprs[i];
+		struct expr *e = &exprs[i];
+		e->type = d->type;
+		if (d->type == EXPR_TYPE_COMMAND) {
+			e->cmd.exe = strs + d->exe;
+			e->cmd.args = d->arg_count > 0 ? args + d->first_arg : NULL;
+			e->cmd.arg_count = d->arg_count;
+			e->cmd.arg_capacity = d->arg_count;
+			e->cmd.in_file = d->in_file != LINE_STR_NONE ?
+					 strs + d->in_file : NULL;
+			e->cmd.err_type = d->err_type;
+			e->cmd.err_file = d->err_file != LINE_STR_NONE ?
+					  strs + d->err_file : NULL;
+		} else {
+			memset(&e->cmd, 0, sizeof(e->cmd));
+		}
+		e->next = i + 1 < b->expr_count ? &exprs[i + 1] : NULL;
 	}
-	cmd->args[cmd->arg_count++] = arg;
+	line->head = exprs;
+	line->tail = &exprs[b->expr_count - 1];
+	line->expr_count = b->expr_count;
+	line->out_type = b->out_type;
+	line->out_file = b->out_type != OUTPUT_TYPE_STDOUT ?
+			 strs + b->out_file : NULL;
+	line->is_background = b->is_background;
+	line_builder_reset(b);
+	return line;
+}
+
+static void
+line_builder_destroy(struct line_builder *b)
+{
+	free(b->exprs);
+	free(b->args);
+	free(b->strs);
 }
 
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
+	/* The whole line is one block. */
+	free(line);
+}
+
+/** Length of a variable name at the start of @a str, 0 if none. */
+static uint32_t
+var_name_len(const char *str)
+{
+	if (!isalpha((unsigned char)str[0]) && str[0] != '_')
+		return 0;
+	uint32_t len = 1;
+	while (isalnum((unsigned char)str[len]) || str[len] == '_')
+		++len;
+	return len;
+}
+
+/**
+ * Substitute the variables of a word into @a out, or only count the
+ * result size if @a out is NULL.
+ * @return Length of the result.
+ */
+static size_t
+word_expand(const char *word, command_line_var_f var, void *ctx, char *out)
+{
+	size_t size = 0;
+	const char *pos = word;
+	while (true) {
+		const char *dollar = strchr(pos, '$');
+		size_t run = dollar != NULL ? (size_t)(dollar - pos) : strlen(pos);
+		if (out != NULL)
+			memcpy(out + size, pos, run);
+		size += run;
+		if (dollar == NULL)
+			return size;
+		bool is_braced = dollar[1] == '{';
+		const char *name = dollar + 1 + is_braced;
+		uint32_t len = var_name_len(name);
+		const char *value = NULL;
+		if (len > 0 && (!is_braced || name[len] == '}'))
+			value = var(name, len, ctx);
+		if (value == NULL) {
+			/* Not a variable, the $ stays as is. */
+			if (out != NULL)
+				out[size] = '$';
+			size++;
+			pos = dollar + 1;
+			continue;
 		}
-		line->head = e->next;
-		free(e);
+		size_t value_len = strlen(value);
+		if (out != NULL)
+			memcpy(out + size, value, value_len);
+		size += value_len;
+		pos = name + len + is_braced;
 	}
-	free(line->out_file);
-	free(line);
 }
 
-static void
-command_line_append(struct command_line *line, struct expr *e)
+/** Put an expanded word at @a pos and move it past the word. */
+static char *
+word_expand_to(const char *word, command_line_var_f var, void *ctx,
+	       char **pos)
+{
+	char *res = *pos;
+	size_t len = word_expand(word, var, ctx, res);
+	res[len] = 0;
+	*pos += len + 1;
+	return res;
+}
+
+struct command_line *
+command_line_expand(const struct command_line *src, command_line_var_f var,
+		    void *ctx)
 {
-	if (line->head == NULL)
-		line->head = e;
-	else
-		line->tail->next = e;
-	line->tail = e;
+	uint32_t arg_count = 0;
+	size_t strs_size = 0;
+	for (const struct expr *e = src->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		strs_size += word_expand(e->cmd.exe, var, ctx, NULL) + 1;
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+			strs_size += word_expand(e->cmd.args[i], var, ctx, NULL) + 1;
+		if (e->cmd.in_file != NULL)
+			strs_size += word_expand(e->cmd.in_file, var, ctx, NULL) + 1;
+		if (e->cmd.err_file != NULL)
+			strs_size += word_expand(e->cmd.err_file, var, ctx, NULL) + 1;
+		arg_count += e->cmd.arg_count;
+	}
+	if (src->out_file != NULL)
+		strs_size += word_expand(src->out_file, var, ctx, NULL) + 1;
+
+	/* The same layout as of a parsed line. */
+	size_t size = sizeof(struct command_line) +
+		      sizeof(struct expr) * src->expr_count +
+		      sizeof(char *) * arg_count + strs_size;
+	struct command_line *line = malloc(size);
+	struct expr *exprs = (struct expr *)(line + 1);
+	char **args = (char **)(exprs + src->expr_count);
+	char *pos = (char *)(args + arg_count);
+	uint32_t i = 0;
+	for (const struct expr *e = src->head; e != NULL; e = e->next, ++i) {
+		struct expr *dst = &exprs[i];
+		dst->type = e->type;
+		memset(&dst->cmd, 0, sizeof(dst->cmd));
+		if (e->type == EXPR_TYPE_COMMAND) {
+			dst->cmd.exe = word_expand_to(e->cmd.exe, var, ctx, &pos);
+			if (e->cmd.arg_count > 0)
+				dst->cmd.args = args;
+			for (uint32_t j = 0; j < e->cmd.arg_count; ++j) {
+				*args++ = word_expand_to(e->cmd.args[j], var, ctx,
+							 &pos);
+			}
+			dst->cmd.arg_count = e->cmd.arg_count;
+			dst->cmd.arg_capacity = e->cmd.arg_count;
+			if (e->cmd.in_file != NULL) {
+				dst->cmd.in_file = word_expand_to(e->cmd.in_file,
+								  var, ctx, &pos);
+			}
+			dst->cmd.err_type = e->cmd.err_type;
+			if (e->cmd.err_file != NULL) {
+				dst->cmd.err_file = word_expand_to(e->cmd.err_file,
+								   var, ctx, &pos);
+			}
+		}
+		dst->next = e->next != NULL ? &exprs[i + 1] : NULL;
+	}
+	assert(i == src->expr_count);
+	line->head = exprs;
+	line->tail = &exprs[i - 1];
+	line->expr_count = i;
+	line->out_type = src->out_type;
+	line->out_file = src->out_file != NULL ?
+			 word_expand_to(src->out_file, var, ctx, &pos) : NULL;
+	line->is_background = src->is_background;
+	return line;
 }
 
 struct parser *
@@ -110,7 +495,24 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	if (p->static_data != NULL) {
+		/* The caller's data may go away, keep the rest in the buffer. */
+		const char *rest = p->static_data + p->pos;
+		uint32_t rest_size = p->size - p->pos;
+		p->static_data = NULL;
+		p->pos = 0;
+		p->size = 0;
+		parser_feed(p, rest, rest_size);
+	}
+	if (len == 0)
+		return;
 	uint32_t cap = p->capacity - p->size;
+	if (cap < len && p->pos > 0) {
+		p->size -= p->pos;
+		memmove(p->buffer, p->buffer + p->pos, p->size);
+		p->pos = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -123,320 +525,456 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 	assert(p->size <= p->capacity);
 }
 
+void
+parser_feed_static(struct parser *p, const char *str, uint32_t len)
+{
+	if (p->static_data != NULL || p->pos < p->size) {
+		parser_feed(p, str, len);
+		return;
+	}
+	p->static_data = str;
+	p->pos = 0;
+	p->size = len;
+}
+
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->pos >= size);
+	p->pos += size;
+	if (p->pos == p->size) {
+		p->pos = 0;
 		p->size = 0;
-		return;
+		p->static_data = NULL;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
-static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+/**
+ * Continue tokenizing from the token state. Each byte is looked at
+ * once, even if the token is fed by parts.
+ * @retval true The token is complete, @a pos_ptr is moved after it.
+ * @retval false The input ended, @a pos_ptr is moved to the end and
+ *         the token keeps its state for the next feed.
+ */
+static bool
+parse_token(struct token *t, const char **pos_ptr, const char *end)
 {
-	token_reset(out);
-	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
-		++pos;
-	}
-	char quote = 0;
+	const char *pos = *pos_ptr;
+	const char *run_end;
 	while (pos < end) {
 		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
+		switch (t->state) {
+		case TOKEN_STATE_START:
+			if (c == '\n') {
+				t->type = TOKEN_TYPE_NEW_LINE;
+				++pos;
+				goto done;
+			}
+			if (isspace(c)) {
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
+			if (c == '#') {
+				t->state = TOKEN_STATE_COMMENT;
 				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
+				continue;
 			}
-			assert(quote == 0);
-			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
+			if (c == '&' || c == '|' || c == '>') {
+				t->state = TOKEN_STATE_OPERATOR;
+				t->op = c;
 				++pos;
 				continue;
 			}
-			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			if (c == '<') {
+				t->type = TOKEN_TYPE_IN;
+				++pos;
+				goto done;
 			}
-			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
+			/*
+			 * Fast path - a plain word is returned as a slice of
+			 * the input, without copying.
+			 */
+			t->state = TOKEN_STATE_STR;
+			run_end = token_scan_run(pos, end, 0);
+			if (run_end == pos + 1 && run_end < end && *run_end == '>' &&
+			    c == '2') {
+				/* 2> is a redirect, not a word. */
+				t->state = TOKEN_STATE_OPERATOR;
+				t->op = '2';
+				pos = run_end + 1;
+				continue;
+			}
+			if (run_end < end && *run_end != '\'' && *run_end != '"' &&
+			    *run_end != '\\') {
+				t->type = TOKEN_TYPE_STR;
+				t->str = pos;
+				t->len = run_end - pos;
+				pos = run_end;
+				goto done;
+			}
+			/* Quotes, escapes or a cut word have to be collected. */
+			token_append(t, pos, run_end - pos);
+			pos = run_end;
+			continue;
+		case TOKEN_STATE_STR:
+			switch (c) {
+			case '\'':
+			case '"':
+				if (t->quote == 0) {
+					t->quote = c;
+					t->is_quoted = true;
+					++pos;
+					continue;
 				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
+				if (t->quote != c)
 					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
+				t->type = TOKEN_TYPE_STR;
+				++pos;
+				goto done;
+			case '\\':
+				if (t->quote == '\'')
 					break;
-				default:
-					assert(false);
+				t->state = TOKEN_STATE_ESCAPE;
+				++pos;
+				continue;
+			case '>':
+				if (t->quote == 0 && !t->is_quoted &&
+				    t->size == 1 && t->data[0] == '2') {
+					/* 2> cut by the end of a feed. */
+					t->size = 0;
+					t->state = TOKEN_STATE_OPERATOR;
+					t->op = '2';
+					++pos;
+					continue;
+				}
+				/* fallthrough */
+			case '&':
+			case '|':
+			case '<':
+			case '#':
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				if (t->quote != 0)
 					break;
+				if (t->size == 0) {
+					/* There was only a line continuation. */
+					t->state = TOKEN_STATE_START;
+					continue;
 				}
+				t->type = TOKEN_TYPE_STR;
+				goto done;
+			default:
+				break;
 			}
-			return pos - begin;
-		case ' ':
-		case '\t':
-		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
-		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
+			/* The current character is ordinary, take all like it. */
+			run_end = token_scan_run(pos + 1, end, t->quote);
+			token_append(t, pos, run_end - pos);
+			pos = run_end;
+			continue;
+		case TOKEN_STATE_ESCAPE:
+			t->state = TOKEN_STATE_STR;
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
+			if (c == '\n')
+				continue;
+			t->is_quoted = true;
+			if (t->quote == '"' && c != '\\' && c != '"')
+				token_append(t, "\\", 1);
+			token_append(t, &c, 1);
+			continue;
+		case TOKEN_STATE_OPERATOR:
+			if (t->op == '2') {
+				if (c == '&') {
+					t->op = '1';
+					++pos;
+					continue;
 				}
+				if (c == '>')
+					++pos;
+				t->type = c == '>' ? TOKEN_TYPE_ERR_APPEND :
+				     TOKEN_TYPE_ERR_NEW;
+				goto done;
+			}
+			if (t->op == '1') {
+				/* Only 2>&1 is supported of the fd duplications. */
+				if (c == '1')
+					++pos;
+				t->type = c == '1' ? TOKEN_TYPE_ERR_TO_OUT :
+				     TOKEN_TYPE_ERR_BAD;
+				goto done;
+			}
+			if (c == t->op)
 				++pos;
+			switch (t->op) {
+			case '&':
+				t->type = c == t->op ? TOKEN_TYPE_AND :
+				     TOKEN_TYPE_BACKGROUND;
+				break;
+			case '|':
+				t->type = c == t->op ? TOKEN_TYPE_OR :
+				     TOKEN_TYPE_PIPE;
+				break;
+			case '>':
+				t->type = c == t->op ? TOKEN_TYPE_OUT_APPEND :
+				     TOKEN_TYPE_OUT_NEW;
+				break;
+			default:
+				assert(false);
+				break;
+			}
+			goto done;
+		case TOKEN_STATE_COMMENT:
+			run_end = memchr(pos, '\n', end - pos);
+			if (run_end == NULL) {
+				pos = end;
+				continue;
 			}
-			return 0;
+			t->type = TOKEN_TYPE_NEW_LINE;
+			pos = run_end + 1;
+			goto done;
 		default:
-			goto append_and_next;
+			assert(false);
 		}
-	append_and_next:
-		token_append(out, c);
-		++pos;
 	}
+	*pos_ptr = pos;
+	return false;
+done:
+	*pos_ptr = pos;
+	return true;
+}
+
+static void
+parser_set_error(struct parser *p, enum parser_error err)
+{
+	p->error = err;
+	p->line_state = LINE_STATE_SKIP;
+}
+
+/**
+ * Add an operator expression after a command.
+ * @retval 0 Success.
+ * @retval -1 No command on the left, the error is set.
+ */
+static int
+parser_append_operator(struct parser *p, enum expr_type type,
+		       enum parser_error no_left_err,
+		       enum parser_error left_not_cmd_err)
+{
+	struct expr_draft *tail = line_builder_tail(&p->line);
+	if (tail == NULL) {
+		parser_set_error(p, no_left_err);
+		return -1;
+	}
+	if (tail->type != EXPR_TYPE_COMMAND) {
+		parser_set_error(p, left_not_cmd_err);
+		return -1;
+	}
+	line_builder_append(&p->line, type);
 	return 0;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+/**
+ * Apply 2>, 2>> or 2>&1 to the last command. The file name of the
+ * first two comes next.
+ */
+static void
+parser_accept_err_redirect(struct parser *p)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	struct expr_draft *tail = line_builder_tail(&p->line);
+	if (tail == NULL || tail->type != EXPR_TYPE_COMMAND ||
+	    p->token.type == TOKEN_TYPE_ERR_BAD) {
+		parser_set_error(p, PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
+		return;
+	}
+	switch (p->token.type) {
+	case TOKEN_TYPE_ERR_TO_OUT:
+		tail->err_type = STDERR_TYPE_STDOUT;
+		tail->err_file = LINE_STR_NONE;
+		return;
+	case TOKEN_TYPE_ERR_NEW:
+		tail->err_type = STDERR_TYPE_FILE_NEW;
+		break;
+	case TOKEN_TYPE_ERR_APPEND:
+		tail->err_type = STDERR_TYPE_FILE_APPEND;
+		break;
+	default:
+		assert(false);
+	}
+	p->after_err_file = p->line_state;
+	p->line_state = LINE_STATE_ERR_FILE;
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
+/**
+ * Apply a complete token to the line being built.
+ * @retval true The line has ended.
+ * @retval false The line goes on.
+ */
+static bool
+parser_accept_token(struct parser *p)
+{
+	struct token *t = &p->token;
+	struct line_builder *line = &p->line;
+	struct expr_draft *tail = line_builder_tail(line);
+	if (t->type == TOKEN_TYPE_NEW_LINE) {
+		/* Skip empty lines. */
+		if (tail == NULL && p->line_state == LINE_STATE_EXPRS)
+			return false;
+		if (p->line_state == LINE_STATE_OUT_FILE)
+			parser_set_error(p, PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+		else if (p->line_state == LINE_STATE_IN_FILE)
+			parser_set_error(p, PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+		else if (p->line_state == LINE_STATE_ERR_FILE)
+			parser_set_error(p, PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
+		if (p->error == PARSER_ERR_NONE &&
+		    (tail == NULL || tail->type != EXPR_TYPE_COMMAND))
+			p->error = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		return true;
+	}
+	switch (p->line_state) {
+	case LINE_STATE_EXPRS:
+		switch (t->type) {
+		case TOKEN_TYPE_STR: {
+			if (tail != NULL && tail->type == EXPR_TYPE_COMMAND) {
+				line_builder_append_arg(line, t);
+				break;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
+			uint32_t exe = line_builder_add_str(line, t);
+			line_builder_append(line, EXPR_TYPE_COMMAND)->exe = exe;
+			break;
+		}
 		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_PIPE,
+					       PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+			break;
 		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_AND,
+					       PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+			break;
 		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_OR,
+					       PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+			break;
 		case TOKEN_TYPE_OUT_NEW:
+			line->out_type = OUTPUT_TYPE_FILE_NEW;
+			p->line_state = LINE_STATE_OUT_FILE;
+			break;
 		case TOKEN_TYPE_OUT_APPEND:
+			line->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->line_state = LINE_STATE_OUT_FILE;
+			break;
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			line->is_background = true;
+			p->line_state = LINE_STATE_AFTER_BACKGROUND;
+			break;
+		case TOKEN_TYPE_IN:
+			if (tail == NULL || tail->type != EXPR_TYPE_COMMAND) {
+				parser_set_error(p, PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+				break;
+			}
+			p->line_state = LINE_STATE_IN_FILE;
+			break;
+		case TOKEN_TYPE_ERR_NEW:
+		case TOKEN_TYPE_ERR_APPEND:
+		case TOKEN_TYPE_ERR_TO_OUT:
+		case TOKEN_TYPE_ERR_BAD:
+			parser_accept_err_redirect(p);
+			break;
 		default:
 			assert(false);
 		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+		break;
+	case LINE_STATE_OUT_FILE:
+		if (t->type != TOKEN_TYPE_STR) {
+			parser_set_error(p, PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+			break;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+		line->out_file = line_builder_add_str(line, t);
+		p->line_state = LINE_STATE_AFTER_OUT;
+		break;
+	case LINE_STATE_AFTER_OUT:
+		if (t->type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			p->line_state = LINE_STATE_AFTER_BACKGROUND;
+			break;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
-	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
+		/* cmd > file 2>&1 */
+		if (t->type == TOKEN_TYPE_ERR_NEW ||
+		    t->type == TOKEN_TYPE_ERR_APPEND ||
+		    t->type == TOKEN_TYPE_ERR_TO_OUT ||
+		    t->type == TOKEN_TYPE_ERR_BAD) {
+			parser_accept_err_redirect(p);
 			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
 		}
+		parser_set_error(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+		break;
+	case LINE_STATE_IN_FILE:
+		if (t->type != TOKEN_TYPE_STR) {
+			parser_set_error(p, PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+			break;
+		}
+		tail->in_file = line_builder_add_str(line, t);
+		p->line_state = LINE_STATE_EXPRS;
+		break;
+	case LINE_STATE_ERR_FILE:
+		if (t->type != TOKEN_TYPE_STR) {
+			parser_set_error(p, PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
+			break;
+		}
+		tail->err_file = line_builder_add_str(line, t);
+		p->line_state = p->after_err_file;
+		break;
+	case LINE_STATE_AFTER_BACKGROUND:
+		parser_set_error(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+		break;
+	case LINE_STATE_SKIP:
+		break;
+	default:
+		assert(false);
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+	return false;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	const char *data = p->static_data != NULL ? p->static_data : p->buffer;
+	const char *begin = data + p->pos;
+	const char *pos = begin;
+	const char *end = data + p->size;
+	enum parser_error res = PARSER_ERR_NONE;
 	*out = NULL;
 
-return_final:
-	free(token.data);
+	while (parse_token(&p->token, &pos, end)) {
+		bool is_line_end = parser_accept_token(p);
+		token_reset(&p->token);
+		if (!is_line_end)
+			continue;
+		res = p->error;
+		if (res == PARSER_ERR_NONE)
+			*out = line_builder_finish(&p->line);
+		else
+			line_builder_reset(&p->line);
+		p->line_state = LINE_STATE_EXPRS;
+		p->error = PARSER_ERR_NONE;
+		break;
+	}
+	/*
+	 * Everything scanned is in the line or the token state now, so
+	 * it is never parsed again.
+	 */
+	parser_consume(p, pos - begin);
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	line_builder_destroy(&p->line);
+	free(p->token.data);
 	free(p->buffer);
 	free(p);
 }
@@ -16,6 +16,19 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_INPUT_REDIRECT_BAD_ARG,
+	PARSER_ERR_STDERR_REDIRECT_BAD_ARG,
+};
+
+/** Where stderr of a command goes. */
+enum stderr_type {
+	STDERR_TYPE_DEFAULT,
+	/** 2> file */
+	STDERR_TYPE_FILE_NEW,
+	/** 2>> file */
+	STDERR_TYPE_FILE_APPEND,
+	/** 2>&1 - wherever stdout of the command goes. */
+	STDERR_TYPE_STDOUT,
 };
 
 struct command {
@@ -23,6 +36,11 @@ struct command {
 	char** args;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
+	/** File of `< file`, or NULL. */
+	char *in_file;
+	enum stderr_type err_type;
+	/** Valid if the err type is FILE. */
+	char *err_file;
 };
 
 enum expr_type {
@@ -45,9 +63,15 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+/**
+ * A parsed line is a single memory block. The expressions are stored
+ * contiguously, so they can be walked both by the next links and as
+ * the array head[0] .. head[expr_count - 1].
+ */
 struct command_line {
 	struct expr *head;
 	struct expr *tail;
+	uint32_t expr_count;
 	enum output_type out_type;
 	/** Valid if the out type is FILE. */
 	char *out_file;
@@ -57,12 +81,37 @@ struct command_line {
 void
 command_line_delete(struct command_line *line);
 
+/**
+ * Value of a variable for command_line_expand().
+ * @retval NULL No such variable.
+ */
+typedef const char *(*command_line_var_f)(const char *name, uint32_t len,
+					  void *ctx);
+
+/**
+ * Copy a parsed line substituting $name and ${name} in all its words.
+ * Unknown names are left as is. Quotes are gone after parsing, so a
+ * quoted $ is substituted too. The copy is one block like a parsed
+ * line and is deleted the same way.
+ */
+struct command_line *
+command_line_expand(const struct command_line *src, command_line_var_f var,
+		    void *ctx);
+
 struct parser *
 parser_new(void);
 
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Feed data without copying it. It is parsed in place, so it has to
+ * stay valid until all the lines in it are popped or the next feed.
+ * Only the unfinished tail is copied then, if any.
+ */
+void
+parser_feed_static(struct parser *p, const char *str, uint32_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
@@ -0,0 +1,320 @@
+#include "parser.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmark of the parser. Synthetic scripts of several kinds are fed
+ * through parser_feed() and parser_pop_next() by chunks of different
+ * sizes, like they come from a pipe, and in place by
+ * parser_feed_static(), like a script of -f. For each kind and chunk
+ * size the throughput and the allocations per parsed line are printed.
+ * A script has to parse into the lines it was made of, without errors.
+ *
+ * $> make bench
+ * $> ./parser_bench [-n bytes] [-r repetitions]
+ */
+
+/**
+ * Allocations are counted by wrappers around the glibc allocator. They
+ * are cheap unlike heap_help, so the times stay real.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t alloc_count;
+
+void *
+malloc(size_t size)
+{
+	++alloc_count;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+	++alloc_count;
+	return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	++alloc_count;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+struct script {
+	char *data;
+	size_t size;
+	size_t capacity;
+	uint64_t line_count;
+};
+
+static void
+script_append(struct script *s, const char *str, size_t len)
+{
+	if (s->size + len > s->capacity) {
+		while (s->size + len > s->capacity)
+			s->capacity = s->capacity == 0 ? 4096 : s->capacity * 2;
+		s->data = realloc(s->data, s->capacity);
+	}
+	memcpy(s->data + s->size, str, len);
+	s->size += len;
+}
+
+static void
+script_appendf(struct script *s, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void
+script_appendf(struct script *s, const char *format, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	script_append(s, buf, len);
+}
+
+/** Typical interactive lines. */
+static void
+gen_simple(struct script *s, uint64_t i)
+{
+	switch (i % 4) {
+	case 0:
+		script_appendf(s, "echo hello world %llu\n",
+			       (unsigned long long)i);
+		break;
+	case 1:
+		script_append(s, "ls -l /usr/bin | grep -v x | wc -l\n", 35);
+		break;
+	case 2:
+		script_appendf(s, "mkdir -p dir%llu && cd dir%llu || exit 1\n",
+			       (unsigned long long)i, (unsigned long long)i);
+		break;
+	default:
+		script_appendf(s, "cat < in%llu 2>&1 >> log.txt &\n",
+			       (unsigned long long)i);
+		break;
+	}
+}
+
+/** A few arguments of 1 KiB each. */
+static void
+gen_long_args(struct script *s, uint64_t i)
+{
+	char arg[1024];
+	memset(arg, 'a' + i % 26, sizeof(arg));
+	script_append(s, "printf", 6);
+	for (int j = 0; j < 4; ++j) {
+		script_append(s, " ", 1);
+		script_append(s, arg, sizeof(arg));
+	}
+	script_append(s, "\n", 1);
+}
+
+/** Quotes, escapes and quoted operators in each word. */
+static void
+gen_quoting(struct script *s, uint64_t i)
+{
+	(void)i;
+	static const char line[] =
+		"echo \"a \\\"b\\\" 'c' \\\\ d\" 'x \"y\" \\z' a\\ b\\ c "
+		"\"|&>#\" '2>&1' \"multi\nline\" x\"y\"'z'\\\"\n";
+	script_append(s, line, sizeof(line) - 1);
+}
+
+/** Pipelines of 100 stages. */
+static void
+gen_pipes(struct script *s, uint64_t i)
+{
+	(void)i;
+	script_append(s, "yes", 3);
+	for (int j = 0; j < 100; ++j)
+		script_append(s, " | cat -u", 9);
+	script_append(s, " | head -n 1\n", 13);
+}
+
+/** Lines of 1 MiB made of 100000 short words. */
+static void
+gen_huge_line(struct script *s, uint64_t i)
+{
+	(void)i;
+	script_append(s, "echo", 4);
+	for (int j = 0; j < 100000; ++j)
+		script_appendf(s, " w%05d", j);
+	script_append(s, "\n", 1);
+}
+
+typedef void (*gen_f)(struct script *s, uint64_t i);
+
+static const struct {
+	const char *name;
+	gen_f gen;
+} kinds[] = {
+	{"simple", gen_simple},
+	{"long-args", gen_long_args},
+	{"quoting", gen_quoting},
+	{"pipes", gen_pipes},
+	{"huge-line", gen_huge_line},
+};
+
+/** Chunk sizes of parser_feed(). 0 means parser_feed_static(). */
+static const uint32_t chunks[] = {16, 1024, 65536, 0};
+
+static struct script
+script_new(gen_f gen, size_t size)
+{
+	struct script s = {0};
+	for (uint64_t i = 0; s.size < size; ++i) {
+		gen(&s, i);
+		s.line_count++;
+	}
+	return s;
+}
+
+static long long
+bench_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/** Pop all the ready lines. @retval Error count. */
+static uint64_t
+bench_pop_all(struct parser *p, uint64_t *line_count)
+{
+	uint64_t errors = 0;
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			++errors;
+			continue;
+		}
+		if (line == NULL)
+			return errors;
+		++*line_count;
+		command_line_delete(line);
+	}
+}
+
+/**
+ * Parse the script once.
+ * @retval 0 Success, the lines are as generated.
+ * @retval -1 Wrong line count or parse errors.
+ */
+static int
+bench_run_once(const struct script *s, uint32_t chunk, long long *time,
+	       uint64_t *allocs)
+{
+	uint64_t line_count = 0;
+	uint64_t errors = 0;
+	uint64_t alloc_start = alloc_count;
+	long long start = bench_now_ns();
+	struct parser *p = parser_new();
+	if (chunk == 0) {
+		parser_feed_static(p, s->data, s->size);
+		errors += bench_pop_all(p, &line_count);
+	} else {
+		for (size_t pos = 0; pos < s->size; pos += chunk) {
+			size_t len = s->size - pos < chunk ? s->size - pos : chunk;
+			parser_feed(p, s->data + pos, len);
+			errors += bench_pop_all(p, &line_count);
+		}
+	}
+	parser_delete(p);
+	*time = bench_now_ns() - start;
+	*allocs = alloc_count - alloc_start;
+	if (errors != 0 || line_count != s->line_count) {
+		printf("Parsed %llu lines with %llu errors instead of %llu\n",
+		       (unsigned long long)line_count,
+		       (unsigned long long)errors,
+		       (unsigned long long)s->line_count);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench_cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 16 << 20;
+	int reps = 5;
+	int c;
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		default:
+			reps = 0;
+			break;
+		}
+	}
+	if (reps <= 0 || size == 0) {
+		printf("Usage: %s [-n bytes] [-r repetitions]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	long long *samples = malloc(reps * sizeof(*samples));
+	int rc = 0;
+	printf("%zu bytes per script, %d repetitions, median times\n", size,
+	       reps);
+	printf("%-10s %-7s %10s %12s %12s\n", "kind", "chunk", "MB/s",
+	       "lines/s", "allocs/line");
+	for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]) && rc == 0;
+	     ++k) {
+		struct script s = script_new(kinds[k].gen, size);
+		for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+			uint64_t allocs = 0;
+			for (int r = 0; r < reps && rc == 0; ++r)
+				rc = bench_run_once(&s, chunks[i], &samples[r],
+						    &allocs);
+			if (rc != 0)
+				break;
+			qsort(samples, reps, sizeof(*samples), bench_cmp_ll);
+			double sec = samples[reps / 2] / 1e9;
+			char chunk_name[16];
+			if (chunks[i] == 0)
+				snprintf(chunk_name, sizeof(chunk_name), "static");
+			else
+				snprintf(chunk_name, sizeof(chunk_name), "%u",
+					 chunks[i]);
+			printf("%-10s %-7s %10.1f %12.0f %12.2f\n", kinds[k].name,
+			       chunk_name, s.size / (1024.0 * 1024.0) / sec,
+			       s.line_count / sec,
+			       (double)allocs / s.line_count);
+		}
+		free(s.data);
+	}
+	free(samples);
+	return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
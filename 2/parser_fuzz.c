@@ -0,0 +1,267 @@
+#include "parser.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fuzz target of the parser for libFuzzer. The input is parsed three
+ * ways: fed at once, fed by chunks of sizes taken from the input, and
+ * in place by parser_feed_static(). All of them have to give the same
+ * lines and errors, so a bug in the handling of the chunk borders is
+ * found as well as a crash. Each line is also expanded by
+ * command_line_expand(). Memory errors are found by the sanitizers, and
+ * slow inputs by the libFuzzer timeout.
+ *
+ * $> make fuzz
+ * $> ./parser_fuzz -max_len=4096 -timeout=1 corpus_dir
+ *
+ * Without clang the same checks run on files, or on inputs generated
+ * from the shell syntax if no files are given:
+ * $> make fuzz_replay
+ * $> ./parser_fuzz_replay [file]...
+ */
+
+/** Text of the parsed lines, to compare the ways of parsing. */
+struct dump {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+dump_append(struct dump *d, const char *str, size_t len)
+{
+	if (d->size + len > d->capacity) {
+		while (d->size + len > d->capacity)
+			d->capacity = d->capacity == 0 ? 256 : d->capacity * 2;
+		d->data = realloc(d->data, d->capacity);
+	}
+	memcpy(d->data + d->size, str, len);
+	d->size += len;
+}
+
+static void
+dump_str(struct dump *d, const char *str)
+{
+	if (str == NULL) {
+		dump_append(d, "-", 1);
+		return;
+	}
+	/* With the length, so the words can't be glued differently. */
+	char len[16];
+	size_t str_len = strlen(str);
+	dump_append(d, len, snprintf(len, sizeof(len), "%zu:", str_len));
+	dump_append(d, str, str_len);
+}
+
+static void
+dump_int(struct dump *d, int val)
+{
+	char buf[16];
+	dump_append(d, buf, snprintf(buf, sizeof(buf), " %d ", val));
+}
+
+static void
+dump_line(struct dump *d, const struct command_line *line)
+{
+	uint32_t count = 0;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		++count;
+		dump_int(d, e->type);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct command *cmd = &e->cmd;
+		dump_str(d, cmd->exe);
+		dump_int(d, cmd->arg_count);
+		for (uint32_t i = 0; i < cmd->arg_count; ++i)
+			dump_str(d, cmd->args[i]);
+		dump_str(d, cmd->in_file);
+		dump_int(d, cmd->err_type);
+		dump_str(d, cmd->err_file);
+	}
+	if (count != line->expr_count || line->head + count - 1 != line->tail)
+		abort();
+	dump_int(d, line->out_type);
+	dump_str(d, line->out_file);
+	dump_int(d, line->is_background);
+	dump_append(d, "\n", 1);
+}
+
+static const char *
+fuzz_var(const char *name, uint32_t len, void *ctx)
+{
+	(void)ctx;
+	return len == 1 && name[0] == 'x' ? "value of x" : NULL;
+}
+
+static void
+fuzz_pop_all(struct parser *p, struct dump *d)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			dump_append(d, "E", 1);
+			dump_int(d, err);
+			dump_append(d, "\n", 1);
+			continue;
+		}
+		if (line == NULL)
+			return;
+		dump_line(d, line);
+		struct command_line *copy = command_line_expand(line, fuzz_var,
+								NULL);
+		command_line_delete(copy);
+		command_line_delete(line);
+	}
+}
+
+/** Newline in the end to finish the last line, if it can be finished. */
+static void
+fuzz_finish(struct parser *p, struct dump *d)
+{
+	parser_feed(p, "\n", 1);
+	fuzz_pop_all(p, d);
+	parser_delete(p);
+}
+
+static void
+fuzz_parse_whole(const char *data, uint32_t size, struct dump *d)
+{
+	struct parser *p = parser_new();
+	parser_feed(p, data, size);
+	fuzz_pop_all(p, d);
+	fuzz_finish(p, d);
+}
+
+static void
+fuzz_parse_static(const char *data, uint32_t size, struct dump *d)
+{
+	struct parser *p = parser_new();
+	parser_feed_static(p, data, size);
+	fuzz_pop_all(p, d);
+	fuzz_finish(p, d);
+}
+
+/** Chunk sizes are 1-16 bytes, from a generator seeded by @a seed. */
+static void
+fuzz_parse_chunks(const char *data, uint32_t size, uint8_t seed,
+		  struct dump *d)
+{
+	struct parser *p = parser_new();
+	uint32_t state = seed * 2654435761U + 1;
+	for (uint32_t pos = 0; pos < size;) {
+		state = state * 1103515245 + 12345;
+		uint32_t len = 1 + (state >> 16) % 16;
+		if (len > size - pos)
+			len = size - pos;
+		parser_feed(p, data + pos, len);
+		fuzz_pop_all(p, d);
+		pos += len;
+	}
+	fuzz_finish(p, d);
+}
+
+static void
+fuzz_check_equal(const struct dump *a, const struct dump *b,
+		 const char *name)
+{
+	if (a->size == b->size &&
+	    (a->size == 0 || memcmp(a->data, b->data, a->size) == 0))
+		return;
+	fprintf(stderr, "Parsed differently %s:\n%.*s\n---\n%.*s\n", name,
+		(int)a->size, a->data, (int)b->size, b->data);
+	abort();
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/** The first byte seeds the chunk sizes, the rest is the script. */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size == 0 || size > UINT32_MAX)
+		return 0;
+	uint8_t seed = data[0];
+	const char *script = (const char *)data + 1;
+	uint32_t script_size = size - 1;
+	struct dump whole = {0};
+	struct dump chunks = {0};
+	struct dump in_place = {0};
+	fuzz_parse_whole(script, script_size, &whole);
+	fuzz_parse_chunks(script, script_size, seed, &chunks);
+	fuzz_parse_static(script, script_size, &in_place);
+	fuzz_check_equal(&whole, &chunks, "by chunks");
+	fuzz_check_equal(&whole, &in_place, "in place");
+	free(whole.data);
+	free(chunks.data);
+	free(in_place.data);
+	return 0;
+}
+
+#ifdef PARSER_FUZZ_MAIN
+
+/** Pieces of the shell syntax the generated inputs are made of. */
+static const char *const atoms[] = {
+	"ls", "echo", "a", "bcd", "$x", "${x}", "${", "$", " ", "  ", "\t",
+	"\n", "\r", "|", "||", "&", "&&", ">", ">>", "<", "2>", "2>>", "2>&1",
+	"2", "<f", "2>e", "\"", "'", "\\", "\\\n", "\"x y\"", "'q \\ z'",
+	"\"a\\\"b\"", "a\\ b", "#c\n", "'#'", "\"&|>\"", "x\"y\"", "'a''b'",
+	"\"m\nl\"",
+};
+
+static int
+fuzz_replay_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	struct dump in = {0};
+	char buf[4096];
+	size_t rc;
+	while ((rc = fread(buf, 1, sizeof(buf), f)) > 0)
+		dump_append(&in, buf, rc);
+	fclose(f);
+	LLVMFuzzerTestOneInput((const uint8_t *)in.data, in.size);
+	free(in.data);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			if (fuzz_replay_file(argv[i]) != 0)
+				return EXIT_FAILURE;
+		}
+		printf("%d inputs passed\n", argc - 1);
+		return EXIT_SUCCESS;
+	}
+	enum { INPUT_COUNT = 100000, ATOMS_MAX = 64 };
+	srand(1);
+	struct dump in = {0};
+	for (int i = 0; i < INPUT_COUNT; ++i) {
+		in.size = 0;
+		char seed = rand();
+		dump_append(&in, &seed, 1);
+		int count = rand() % ATOMS_MAX;
+		for (int j = 0; j < count; ++j) {
+			const char *atom =
+				atoms[rand() % (sizeof(atoms) / sizeof(atoms[0]))];
+			dump_append(&in, atom, strlen(atom));
+		}
+		LLVMFuzzerTestOneInput((const uint8_t *)in.data, in.size);
+	}
+	free(in.data);
+	printf("%d generated inputs passed\n", INPUT_COUNT);
+	return EXIT_SUCCESS;
+}
+
+#endif /* PARSER_FUZZ_MAIN */
@@ -773,6 +773,89 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_redirects(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "sort < in.txt -r 2>err.txt | wc 2>&1 > out.txt 2>> log";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "sort") == 0, "exe");
+	unit_check(e->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "-r") == 0, "arg after <");
+	unit_check(strcmp(e->cmd.in_file, "in.txt") == 0, "in file");
+	unit_check(e->cmd.err_type == STDERR_TYPE_FILE_NEW, "err type");
+	unit_check(strcmp(e->cmd.err_file, "err.txt") == 0, "err file");
+	e = e->next->next;
+	unit_check(strcmp(e->cmd.exe, "wc") == 0, "exe");
+	unit_check(e->cmd.in_file == NULL, "no in file");
+	unit_check(e->cmd.err_type == STDERR_TYPE_FILE_APPEND, "the last 2> wins");
+	unit_check(strcmp(e->cmd.err_file, "log") == 0, "err file");
+	command_line_delete(line);
+
+	unit_msg("2 is a word when not right before >");
+	parser_feed(p, "echo 2 >f\n", 10);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(line->head->cmd.args[0], "2") == 0, "arg");
+	unit_check(line->head->cmd.err_type == STDERR_TYPE_DEFAULT, "no 2>");
+	command_line_delete(line);
+	parser_feed(p, "echo a2>g\n", 10);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "a2") == 0, "arg");
+	unit_check(strcmp(line->out_file, "g") == 0, "out file");
+	command_line_delete(line);
+
+	unit_msg("escaped or quoted 2 is a word");
+	const char *words[] = {"echo \\2>x\n", "echo '2'>x\n", "echo \"2\">x\n"};
+	for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+		/* By one char too, to cut the word right before >. */
+		for (int by_char = 0; by_char < 2; ++by_char) {
+			len = strlen(words[i]);
+			for (uint32_t j = 0; j < len; ++j) {
+				uint32_t size = by_char ? 1 : len;
+				parser_feed(p, &words[i][j], size);
+				j += size - 1;
+			}
+			unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE,
+				   words[i]);
+			unit_check(line->head->cmd.arg_count == 1 &&
+				   strcmp(line->head->cmd.args[0], "2") == 0, "arg");
+			unit_check(line->head->cmd.err_type == STDERR_TYPE_DEFAULT,
+				   "no 2>");
+			unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW &&
+				   strcmp(line->out_file, "x") == 0, "out file");
+			command_line_delete(line);
+		}
+	}
+	parser_feed(p, "echo 2\\\n>x\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.err_type == STDERR_TYPE_FILE_NEW,
+		   "2> split by a line continuation");
+	command_line_delete(line);
+
+	parser_feed(p, "ls 2>&1\n", 8);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.err_type == STDERR_TYPE_STDOUT, "2>&1");
+	unit_check(line->head->cmd.err_file == NULL, "no err file");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -808,6 +891,12 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "< file", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe <", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe < |", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe 2>", PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe 2>&2", PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe | 2>&1", PARSER_ERR_STDERR_REDIRECT_BAD_ARG);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -819,6 +908,53 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static const char *
+test_var(const char *name, uint32_t len, void *ctx)
+{
+	(void)ctx;
+	if (len == 1 && name[0] == 'x')
+		return "value";
+	if (len == 2 && memcmp(name, "xy", 2) == 0)
+		return "";
+	return NULL;
+}
+
+static void
+test_expand(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo $x ${x}1 $xy-$z $ a$ | cat$x >> f_$x &\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct command_line *copy = command_line_expand(line, test_var, NULL);
+	command_line_delete(line);
+	unit_check(copy->expr_count == 3, "expr count");
+	struct expr *e = copy->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 5, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "value") == 0, "$x");
+	unit_check(strcmp(e->cmd.args[1], "value1") == 0, "${x}");
+	unit_check(strcmp(e->cmd.args[2], "-$z") == 0, "empty and unknown");
+	unit_check(strcmp(e->cmd.args[3], "$") == 0, "lone $");
+	unit_check(strcmp(e->cmd.args[4], "a$") == 0, "trailing $");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "pipe");
+	e = e->next;
+	unit_check(strcmp(e->cmd.exe, "catvalue") == 0, "second exe");
+	unit_check(e->cmd.arg_count == 0 && e->next == NULL, "last expr");
+	unit_check(copy->tail == e, "tail");
+	unit_check(copy->out_type == OUTPUT_TYPE_FILE_APPEND, "out type");
+	unit_check(strcmp(copy->out_file, "f_value") == 0, "out file");
+	unit_check(copy->is_background, "is background");
+	command_line_delete(copy);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -833,6 +969,8 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_redirects();
 	test_errors();
+	test_expand();
 	return 0;
 }
@@ -0,0 +1,215 @@
+#include "path_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	PATH_CACHE_MIN_BUCKETS = 64,
+	/** Enough for the confstr() default PATH on any libc in use. */
+	PATH_DEFAULT_MAX = 256,
+};
+
+struct path_entry {
+	char *name;
+	char *path;
+	uint32_t hash;
+	struct path_entry *next;
+};
+
+struct path_cache {
+	/** Chains of entries, the count is a power of 2. */
+	struct path_entry **buckets;
+	uint32_t bucket_count;
+	uint32_t count;
+	/** PATH the entries were found with. */
+	char *path_env;
+};
+
+/** FNV-1a. */
+static uint32_t
+path_hash(const char *str)
+{
+	uint32_t h = 2166136261u;
+	for (; *str != 0; ++str) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct path_cache *
+path_cache_new(void)
+{
+	struct path_cache *c = calloc(1, sizeof(*c));
+	c->bucket_count = PATH_CACHE_MIN_BUCKETS;
+	c->buckets = calloc(c->bucket_count, sizeof(*c->buckets));
+	return c;
+}
+
+void
+path_cache_clear(struct path_cache *c)
+{
+	for (uint32_t i = 0; i < c->bucket_count; ++i) {
+		struct path_entry *e = c->buckets[i];
+		while (e != NULL) {
+			struct path_entry *next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		c->buckets[i] = NULL;
+	}
+	c->count = 0;
+}
+
+void
+path_cache_delete(struct path_cache *c)
+{
+	path_cache_clear(c);
+	free(c->buckets);
+	free(c->path_env);
+	free(c);
+}
+
+static struct path_entry **
+path_cache_lookup(struct path_cache *c, const char *name, uint32_t hash)
+{
+	struct path_entry **e = &c->buckets[hash & (c->bucket_count - 1)];
+	while (*e != NULL &&
+	       ((*e)->hash != hash || strcmp((*e)->name, name) != 0))
+		e = &(*e)->next;
+	return e;
+}
+
+static void
+path_cache_grow(struct path_cache *c)
+{
+	uint32_t new_count = c->bucket_count * 2;
+	struct path_entry **buckets = calloc(new_count, sizeof(*buckets));
+	for (uint32_t i = 0; i < c->bucket_count; ++i) {
+		struct path_entry *e = c->buckets[i];
+		while (e != NULL) {
+			struct path_entry *next = e->next;
+			struct path_entry **head = &buckets[e->hash & (new_count - 1)];
+			e->next = *head;
+			*head = e;
+			e = next;
+		}
+	}
+	free(c->buckets);
+	c->buckets = buckets;
+	c->bucket_count = new_count;
+}
+
+/** The PATH execvp() searches when the variable is unset. */
+static const char *
+path_default(void)
+{
+	static char path[PATH_DEFAULT_MAX];
+	if (path[0] != 0)
+		return path;
+	size_t size = confstr(_CS_PATH, path, sizeof(path));
+	if (size == 0 || size > sizeof(path))
+		strcpy(path, "/bin:/usr/bin");
+	return path;
+}
+
+/** Drop the entries if PATH isn't the one they were found with. */
+static void
+path_cache_check_env(struct path_cache *c)
+{
+	const char *env = getenv("PATH");
+	if (env == NULL)
+		env = path_default();
+	if (c->path_env != NULL && strcmp(c->path_env, env) == 0)
+		return;
+	path_cache_clear(c);
+	free(c->path_env);
+	c->path_env = strdup(env);
+}
+
+/** Search PATH like execvp() does. An empty item is the current dir. */
+static char *
+path_search(const char *path_env, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	while (true) {
+		const char *dir_end = strchr(dir, ':');
+		if (dir_end == NULL)
+			dir_end = dir + strlen(dir);
+		size_t dir_len = dir_end - dir;
+		char *path = malloc(dir_len + name_len + 2);
+		size_t len = 0;
+		if (dir_len > 0) {
+			memcpy(path, dir, dir_len);
+			path[dir_len] = '/';
+			len = dir_len + 1;
+		}
+		memcpy(path + len, name, name_len + 1);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (*dir_end == 0)
+			return NULL;
+		dir = dir_end + 1;
+	}
+}
+
+const char *
+path_cache_find(struct path_cache *c, const char *name)
+{
+	if (strchr(name, '/') != NULL)
+		return name;
+	path_cache_check_env(c);
+	uint32_t hash = path_hash(name);
+	struct path_entry **pos = path_cache_lookup(c, name, hash);
+	if (*pos != NULL)
+		return (*pos)->path;
+	char *path = path_search(c->path_env, name);
+	if (path == NULL)
+		return NULL;
+	struct path_entry *e = malloc(sizeof(*e));
+	e->name = strdup(name);
+	e->path = path;
+	e->hash = hash;
+	e->next = *pos;
+	*pos = e;
+	if (++c->count > c->bucket_count)
+		path_cache_grow(c);
+	return path;
+}
+
+void
+path_cache_forget(struct path_cache *c, const char *name)
+{
+	struct path_entry **pos = path_cache_lookup(c, name, path_hash(name));
+	struct path_entry *e = *pos;
+	if (e == NULL)
+		return;
+	*pos = e->next;
+	free(e->name);
+	free(e->path);
+	free(e);
+	c->count--;
+}
+
+void
+path_cache_print(const struct path_cache *c, FILE *out)
+{
+	if (c->count == 0) {
+		fprintf(out, "hash: hash table empty\n");
+		return;
+	}
+	for (uint32_t i = 0; i < c->bucket_count; ++i) {
+		for (struct path_entry *e = c->buckets[i]; e != NULL; e = e->next)
+			fprintf(out, "%s\t%s\n", e->name, e->path);
+	}
+}
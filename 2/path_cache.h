@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdio.h>
+
+/**
+ * Cache of the executables found by a PATH search, like the hash
+ * builtin of bash. A command is searched in PATH once, and then its
+ * absolute path is taken from a hash table. The cache is dropped when
+ * PATH changes.
+ */
+struct path_cache;
+
+struct path_cache *
+path_cache_new(void);
+
+void
+path_cache_delete(struct path_cache *c);
+
+/**
+ * Resolve a command name into a path to execute. Names with a slash
+ * are returned as is. The result is valid until the cache changes.
+ * @retval NULL The command is not found.
+ */
+const char *
+path_cache_find(struct path_cache *c, const char *name);
+
+/** Forget one name, for example when its cached path has gone. */
+void
+path_cache_forget(struct path_cache *c, const char *name);
+
+/** Forget all names. */
+void
+path_cache_clear(struct path_cache *c);
+
+/** Print the cached names and paths. */
+void
+path_cache_print(const struct path_cache *c, FILE *out);
@@ -1,14 +1,29 @@
+#define _GNU_SOURCE
 #include "parser.h"
+#include "builtin.h"
+#include "path_cache.h"
+#include "timing.h"
+#include "launcher.h"
+#include "stream.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+
+extern char **environ;
 
 static int
 execute_cd(const struct expr *e) {
@@ -50,182 +65,1503 @@ execute_cd(const struct expr *e) {
 	return 0;
 }
 
-void
-execute_exit(const struct expr *e) {
-	if (e->cmd.arg_count == 0) { 
-		exit(0);
+/**
+ * Start a command with posix_spawn(). The stdin and stdout are given
+ * as dup2() file actions, so the shell is never copied like with
+ * fork(): glibc starts the child on the shell's memory, vfork-style.
+ * The shell's own descriptors are all O_CLOEXEC, the child doesn't
+ * get them. The executable is taken from the path cache, so PATH
+ * isn't searched with a failed exec per directory on each launch.
+ * With -z the command is started by the launcher process instead.
+ * @retval Child pid or -1 if it couldn't start.
+ */
+static pid_t
+spawn_command(const struct expr *e, int in_fd, int out_fd,
+	      struct path_cache *paths, struct launcher *launcher)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd != STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+	char *argv[e->cmd.arg_count + 2];
+	argv[0] = e->cmd.exe;
+	for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+		argv[i + 1] = e->cmd.args[i];
+	argv[e->cmd.arg_count + 1] = NULL;
+
+	/* The stderr can be redirected for the stage, it is passed as is. */
+	const int fds[3] = {in_fd, out_fd, STDERR_FILENO};
+	pid_t pid;
+	int rc = ENOENT;
+	/* The child writes to the same stdout, the buffered output goes first. */
+	fflush(NULL);
+	const char *path = path_cache_find(paths, e->cmd.exe);
+	for (int attempt = 0; attempt < 2 && path != NULL; ++attempt) {
+		if (launcher != NULL)
+			rc = launcher_spawn(launcher, path, argv, fds, &pid);
+		else
+			rc = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+		if (rc != ENOENT || path == e->cmd.exe)
+			break;
+		/* The cached file has gone, search again. */
+		path_cache_forget(paths, e->cmd.exe);
+		path = path_cache_find(paths, e->cmd.exe);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", e->cmd.exe, strerror(rc));
+		return -1;
+	}
+	return pid;
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
 	}
+	return 0;
+}
 
-	exit(atoi(e->cmd.args[0]));
+/** How much can be written into an empty pipe without blocking. */
+static size_t
+pipe_capacity(int fd)
+{
+#ifdef F_GETPIPE_SZ
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	if (size > 0)
+		return size;
+#else
+	(void)fd;
+#endif
+	return PIPE_BUF;
 }
 
-static void
-execute_command(const struct expr *e) {
-/*
-		// Отладка
-		printf("execvp cmd: %s\n", cmd->exe);
-		for (uint32_t i = 0; i < cmd->arg_count; ++i) {
-    		printf("execvp args[%d]: %s\n", i, cmd->args[i]);
+/**
+ * Run a builtin inside the shell and send its output where the stdout
+ * of the command goes. The only case a process is needed is when the
+ * output doesn't fit into a new pipe: the reader is not started yet,
+ * so the shell would block. Then a forked child writes it.
+ * @param is_pipe The output is a pipe to the next stage.
+ * @param pid Set to the child pid, or -1 if there is no child.
+ * @return Status of the builtin.
+ */
+static int
+execute_builtin(builtin_f func, const struct expr *e, int out_fd,
+		bool is_pipe, pid_t *pid)
+{
+	struct builtin_out out = {0};
+	int status = func(&e->cmd, &out);
+	*pid = -1;
+	if (is_pipe && out.size > pipe_capacity(out_fd)) {
+		fflush(NULL);
+		*pid = fork();
+		if (*pid == 0) {
+			/*
+			 * O_CLOEXEC doesn't act without exec. Other pipe
+			 * ends would be held open, and the writer would block
+			 * instead of getting EPIPE when the reader is gone.
+			 */
+			dup2(out_fd, STDOUT_FILENO);
+			close_range(STDERR_FILENO + 1, ~0U, 0);
+			write_all(STDOUT_FILENO, out.data, out.size);
+			_exit(status);
 		}
-		printf("execvp args size: %d\n", cmd->arg_count);
-		//
-*/
+		if (*pid == -1)
+			perror("fork");
+	} else if (out_fd == STDOUT_FILENO) {
+		/* Buffered in the script mode, direct otherwise. */
+		fwrite(out.data, 1, out.size, stdout);
+	} else {
+		write_all(out_fd, out.data, out.size);
+	}
+	builtin_out_destroy(&out);
+	return status;
+}
+
+/**
+ * Run a stream builtin in a forked child, it can run for long and block
+ * on the pipes. The child closes the other descriptors of the shell,
+ * so it doesn't hold the pipes of the other jobs open.
+ * @retval Child pid or -1 if it couldn't start.
+ */
+static pid_t
+execute_stream(stream_builtin_f func, const struct expr *e, int in_fd,
+	       int out_fd)
+{
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (in_fd != STDIN_FILENO)
+			dup2(in_fd, STDIN_FILENO);
+		if (out_fd != STDOUT_FILENO)
+			dup2(out_fd, STDOUT_FILENO);
+		close_range(STDERR_FILENO + 1, ~0U, 0);
+		int status = func(&e->cmd, STDIN_FILENO, STDOUT_FILENO);
+		fflush(stderr);
+		_exit(status);
+	}
+	if (pid == -1)
+		perror("fork");
+	return pid;
+}
+
+static int
+execute_hash(const struct expr *e, struct path_cache *paths)
+{
+	if (e->cmd.arg_count == 0) {
+		path_cache_print(paths, stdout);
+		return 0;
+	}
+	if (e->cmd.arg_count == 1 && strcmp(e->cmd.args[0], "-r") == 0) {
+		path_cache_clear(paths);
+		return 0;
+	}
+	fprintf(stderr, "hash: usage: hash [-r]\n");
+	return 1;
+}
+
+/**
+ * A running command line. Its pipelines are started one by one, the
+ * next one when all the processes of the previous one have exited
+ * and the && or || before it agrees with the status.
+ */
+struct job {
+	struct command_line *line;
+	/** Where to continue: a pipeline start, an operator or NULL. */
+	const struct expr *cur;
+	/** Processes of the current pipeline not reaped yet. */
+	int running;
+	/** Process of the last stage, it gives the status. 0 if none. */
+	pid_t last_pid;
+	int status;
+	/** Stages of the current pipeline if it runs under `time`. */
+	struct pipeline_time *timing;
+	bool is_background;
+	/** `wait` runs: the job waits for all the background jobs. */
+	bool is_waiting;
+	/**
+	 * Where the stdout of the line goes. For a grouped background job
+	 * it is a memfd printed when the job ends.
+	 */
+	int out_fd;
+	struct job *next;
+};
+
+/**
+ * A child process watched by its pidfd. The children of the launcher
+ * have no pidfd, the launcher reports their exits.
+ */
+struct child {
+	pid_t pid;
+	int pidfd;
+	/** Links in the shell's list of the children of this kind. */
+	struct child *prev;
+	struct child *next;
+	struct job *job;
+	/** The stage to account the usage to, if timed. */
+	struct stage_time *time;
+};
+
+/** Counters for -s. */
+struct shell_stats {
+	uint64_t lines;
+	uint64_t commands;
+	uint64_t bytes;
+	/** Time spent in the parser. */
+	uint64_t parse_ns;
+};
+
+/**
+ * A for or while loop. Its lines are parsed once, when the loop is
+ * read. Each iteration runs copies of them with the loop variables
+ * substituted, the text is never parsed again.
+ */
+struct loop {
+	/** `for NAME in WORDS...` or `while COMMAND...`. */
+	struct command_line *head;
+	/** The lines between `do` and `done`. */
+	struct command_line **body;
+	uint32_t body_count;
+	uint32_t body_capacity;
+	/** Next line of the body. body_count between iterations. */
+	uint32_t pc;
+	/** The words of for taken, the last one is the current value. */
+	uint32_t word;
+	/** The while condition is running, its status decides. */
+	bool is_checking;
+	/** The outermost loop owns the body, the nested ones refer to it. */
+	bool is_body_owner;
+	struct loop *parent;
+};
+
+struct shell {
+	int epoll_fd;
+	struct parser *parser;
+	struct path_cache *paths;
+	/** All the running jobs, foreground and background. */
+	struct job *jobs;
+	/** The job new lines wait for. NULL if they can start. */
+	struct job *fg;
+	int bg_count;
+	/** Max background jobs at once set by `parallel`, 0 - no limit. */
+	int bg_limit;
+	/** Background job output is grouped per job. */
+	bool is_bg_grouped;
+	/** A background line waiting for a free slot. */
+	struct command_line *pending;
+	/** The innermost running loop. */
+	struct loop *loop;
+	/** A loop being read, it runs when its done is read. */
+	struct loop *reading;
+	/** Depth of the nested loops inside the one being read. */
+	int reading_depth;
+	/** The line after a loop header has to be `do`. */
+	bool is_do_expected;
+	int last_status;
+	bool is_eof;
+	/** The input is a regular file or a script, epoll can't watch it. */
+	bool is_input_file;
+	bool is_stdin_watched;
+	/** Script of -f, mapped and parsed in place. NULL for stdin. */
+	const char *script;
+	size_t script_size;
+	size_t script_pos;
+	bool is_stats;
+	struct shell_stats stats;
+	/** exit was called, the shell stops after the current job. */
+	bool is_exit;
+	/** Starts the commands with -z, NULL otherwise. */
+	struct launcher *launcher;
+	/** Running children watched by pidfds. */
+	struct child *watched;
+	/** Running children of the launcher. */
+	struct child *launched;
+	/** Children which got no pidfd, polled by wait4(). */
+	struct child *unwatched;
+	/** Capacity of the pipes between stages, 0 - system default. */
+	int pipe_size;
+};
+
+static int
+pidfd_open_compat(pid_t pid)
+{
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void
+child_list_add(struct child **list, struct child *c)
+{
+	c->prev = NULL;
+	c->next = *list;
+	if (*list != NULL)
+		(*list)->prev = c;
+	*list = c;
+}
+
+static void
+child_list_remove(struct child **list, struct child *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		*list = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+}
 
-	if (!strcmp(e->cmd.exe, "exit")) {
-		execute_exit(e);
+/** Forget the children left running by exit, they are not waited for. */
+static void
+child_list_delete(struct child **list)
+{
+	while (*list != NULL) {
+		struct child *c = *list;
+		*list = c->next;
+		if (c->pidfd >= 0)
+			close(c->pidfd);
+		free(c);
+	}
+}
+
+/**
+ * Watch a child of the stage. @a is_launched - it was started by the
+ * launcher, otherwise it is the shell's own child.
+ */
+static void
+shell_watch_child(struct shell *sh, struct job *job, pid_t pid,
+		  bool is_launched, struct stage_time *time)
+{
+	struct child *c = malloc(sizeof(*c));
+	c->pid = pid;
+	c->job = job;
+	c->time = time;
+	job->running++;
+	if (is_launched) {
+		c->pidfd = -1;
+		child_list_add(&sh->launched, c);
 		return;
 	}
+	c->pidfd = pidfd_open_compat(pid);
+	if (c->pidfd < 0) {
+		perror("pidfd_open");
+	} else {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = c,
+		};
+		if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, c->pidfd, &ev) == 0) {
+			child_list_add(&sh->watched, c);
+			return;
+		}
+		perror("epoll_ctl");
+		close(c->pidfd);
+		c->pidfd = -1;
+	}
+	/*
+	 * An old kernel or the fd limit. Waiting for the child right here
+	 * would hang a pipeline whose next stages are not started yet, so
+	 * the event loop polls it.
+	 */
+	child_list_add(&sh->unwatched, c);
+}
 
-	char *temp[e->cmd.arg_count + 2];
-	temp[0] = e->cmd.exe;
+/**
+ * parallel [-j N] [-g|-u]
+ *
+ * Limit the background jobs: a line with & waits while N of them run.
+ * -g groups the stdout of each background job and prints it at once
+ * when the job ends, -u turns that off. Without arguments the current
+ * settings are printed.
+ */
+static int
+execute_parallel(const struct expr *e, struct shell *sh)
+{
+	const struct command *cmd = &e->cmd;
+	if (cmd->arg_count == 0) {
+		printf("parallel -j %d %s\n", sh->bg_limit,
+		       sh->is_bg_grouped ? "-g" : "-u");
+		return 0;
+	}
+	int limit = sh->bg_limit;
+	bool is_grouped = sh->is_bg_grouped;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (strcmp(arg, "-g") == 0) {
+			is_grouped = true;
+		} else if (strcmp(arg, "-u") == 0) {
+			is_grouped = false;
+		} else if (strcmp(arg, "-j") == 0 && i + 1 < cmd->arg_count) {
+			char *end;
+			long val = strtol(cmd->args[++i], &end, 10);
+			if (*end != 0 || end == cmd->args[i] || val < 0 ||
+			    val > INT_MAX)
+				goto usage;
+			limit = val;
+		} else {
+			goto usage;
+		}
+	}
+	sh->bg_limit = limit;
+	sh->is_bg_grouped = is_grouped;
+	return 0;
+usage:
+	fprintf(stderr, "parallel: usage: parallel [-j N] [-g|-u]\n");
+	return 1;
+}
 
-	for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
-		temp[i + 1] = e->cmd.args[i];
+/**
+ * Parse a pipe size: bytes with an optional k or m suffix.
+ * @retval -1 Bad size.
+ */
+static int
+pipe_size_parse(const char *str)
+{
+	char *end;
+	long long val = strtoll(str, &end, 10);
+	if (end == str || val < 0)
+		return -1;
+	if (*end == 'k' || *end == 'K') {
+		val *= 1024;
+		++end;
+	} else if (*end == 'm' || *end == 'M') {
+		val *= 1024 * 1024;
+		++end;
 	}
-	temp[e->cmd.arg_count + 1] = NULL;
+	if (*end != 0 || val > INT_MAX)
+		return -1;
+	return val;
+}
 
-	execvp(e->cmd.exe, temp);
+/**
+ * Set the capacity of a new pipe.
+ * @retval The capacity, the kernel rounds it up.
+ * @retval -1 Error, it is printed.
+ */
+static int
+pipe_set_size(int fd, int size)
+{
+	int rc = fcntl(fd, F_SETPIPE_SZ, size);
+	if (rc < 0)
+		fprintf(stderr, "pipesize: %d: %s\n", size, strerror(errno));
+	return rc;
 }
 
+/**
+ * pipesize [SIZE]
+ *
+ * Set the capacity of the pipes between the stages of the next
+ * pipelines, 0 returns the system default. Bigger pipes mean fewer
+ * switches between the stages on big streams. Without arguments the
+ * current setting is printed. As a prefix, `pipesize SIZE COMMAND...`,
+ * it is for one pipeline only.
+ */
 static int
-execute_command_line(const struct command_line *line)
+execute_pipesize(const struct expr *e, struct shell *sh)
 {
+	const struct command *cmd = &e->cmd;
+	if (cmd->arg_count == 0) {
+		printf("pipesize %d\n", sh->pipe_size);
+		return 0;
+	}
+	int size = cmd->arg_count == 1 ? pipe_size_parse(cmd->args[0]) : -1;
+	if (size < 0) {
+		fprintf(stderr, "pipesize: usage: pipesize [SIZE[k|m]]\n");
+		return 1;
+	}
+	if (size == 0) {
+		sh->pipe_size = 0;
+		return 0;
+	}
+	/* Checked on a pipe, the limit for users is in pipe-max-size. */
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	size = pipe_set_size(fds[1], size);
+	close(fds[0]);
+	close(fds[1]);
+	if (size < 0)
+		return 1;
+	sh->pipe_size = size;
+	return 0;
+}
+
+/**
+ * Check for the `pipesize SIZE` prefix of the first command and drop
+ * it from @a first.
+ * @return Pipe capacity for the pipeline.
+ */
+static int
+pipeline_pipe_size(struct expr *first, int pipe_size)
+{
+	struct command *cmd = &first->cmd;
+	if (cmd->exe == NULL || strcmp(cmd->exe, "pipesize") != 0 ||
+	    cmd->arg_count < 2)
+		return pipe_size;
+	int size = pipe_size_parse(cmd->args[0]);
+	if (size < 0)
+		return pipe_size;
+	cmd->exe = cmd->args[1];
+	cmd->args += 2;
+	cmd->arg_count -= 2;
+	return size;
+}
+
+/**
+ * Descriptors of a pipeline stage. The redirection targets are opened
+ * once, by the shell, and the stage only gets them.
+ */
+struct stage_fds {
+	int in;
+	int out;
+	int err;
+	/** Opened for this stage, closed when it has started. */
+	int opened[3];
+	int opened_count;
+};
+
+static int
+stage_open(struct stage_fds *fds, const char *path, int flags)
+{
+	int fd = open(path, flags | O_CLOEXEC, 0644);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	else
+		fds->opened[fds->opened_count++] = fd;
+	return fd;
+}
+
+static void
+stage_close(struct stage_fds *fds)
+{
+	for (int i = 0; i < fds->opened_count; ++i)
+		close(fds->opened[i]);
+	fds->opened_count = 0;
+}
+
+/**
+ * Plan the descriptors of a stage. < replaces the pipe input, the
+ * line's > file is the stdout of the last command of the line only,
+ * 2>&1 follows wherever the stdout goes.
+ * @retval 0 Success.
+ * @retval -1 A file couldn't be opened, the error is printed.
+ */
+static int
+stage_open_files(struct stage_fds *fds, const struct expr *e,
+		 const struct command_line *line, bool is_tail)
+{
+	const struct command *cmd = &e->cmd;
+	if (cmd->in_file != NULL) {
+		fds->in = stage_open(fds, cmd->in_file, O_RDONLY);
+		if (fds->in < 0)
+			goto fail;
+	}
+	if (is_tail && line->out_type != OUTPUT_TYPE_STDOUT) {
+		int flags = O_CREAT | O_WRONLY;
+		flags |= line->out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+		fds->out = stage_open(fds, line->out_file, flags);
+		if (fds->out < 0)
+			goto fail;
+	}
+	if (cmd->err_type == STDERR_TYPE_STDOUT) {
+		fds->err = fds->out;
+	} else if (cmd->err_type != STDERR_TYPE_DEFAULT) {
+		int flags = O_CREAT | O_WRONLY;
+		flags |= cmd->err_type == STDERR_TYPE_FILE_NEW ? O_TRUNC : O_APPEND;
+		fds->err = stage_open(fds, cmd->err_file, flags);
+		if (fds->err < 0)
+			goto fail;
+	}
+	return 0;
+fail:
+	stage_close(fds);
+	return -1;
+}
+
+/**
+ * Point the shell's stderr to the stage's one while the stage starts.
+ * The builtins print errors right to stderr, and a spawned child
+ * inherits it. No syscalls if stderr is not redirected.
+ * @return The saved stderr to restore, or -1.
+ */
+static int
+stage_redirect_stderr(const struct stage_fds *fds)
+{
+	if (fds->err == STDERR_FILENO)
+		return -1;
+	fflush(stderr);
+	int saved = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+	dup2(fds->err, STDERR_FILENO);
+	return saved;
+}
+
+static void
+stage_restore_stderr(int saved)
+{
+	if (saved < 0)
+		return;
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+}
+
+/**
+ * Check for the `time [-j]` prefix of the pipeline at @a start. If it
+ * is there, the first command without the prefix is put into @a first.
+ * Its exe is NULL if nothing follows the prefix.
+ * @retval NULL The pipeline is not timed.
+ */
+static struct pipeline_time *
+pipeline_time_parse(const struct expr *start, struct expr *first)
+{
+	if (strcmp(start->cmd.exe, "time") != 0)
+		return NULL;
+	uint32_t stage_count = 0;
+	for (const struct expr *e = start; e != NULL &&
+	     e->type != EXPR_TYPE_AND && e->type != EXPR_TYPE_OR; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND)
+			stage_count++;
+	}
+	*first = *start;
+	struct command *cmd = &first->cmd;
+	bool is_json = cmd->arg_count > 0 && strcmp(cmd->args[0], "-j") == 0;
+	uint32_t skip = is_json ? 1 : 0;
+	cmd->exe = skip < cmd->arg_count ? cmd->args[skip] : NULL;
+	skip = cmd->exe != NULL ? skip + 1 : cmd->arg_count;
+	cmd->args += skip;
+	cmd->arg_count -= skip;
+	return pipeline_time_new(stage_count, is_json);
+}
+
+/**
+ * Start the pipeline at job->cur. Builtins finish right here, the
+ * other stages are left running and are watched by pidfds.
+ */
+static void
+job_start_pipeline(struct shell *sh, struct job *job)
+{
+	const struct command_line *line = job->line;
+	const struct expr *start = job->cur;
+	const struct expr *e = start;
 	int pipefd[2];
-	int proc_wait = 1;
-	int pid;
-	int last_status = 0;
-	int pipe_stdin = 0;
-	const struct expr *e = line->head;
-
-	while (e != NULL) {
-		if (e->type == EXPR_TYPE_COMMAND) {
-			if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-				if (pipe(pipefd) == -1) {
-					perror("pipe");
-					exit(EXIT_FAILURE);
-				}
+	int pipe_stdin = STDIN_FILENO;
+	job->last_pid = 0;
+	struct expr first = *start;
+	job->timing = pipeline_time_parse(start, &first);
+	int pipe_size = pipeline_pipe_size(&first, sh->pipe_size);
+
+	for (; e != NULL && e->type != EXPR_TYPE_AND && e->type != EXPR_TYPE_OR;
+	     e = e->next) {
+		if (e->type == EXPR_TYPE_PIPE)
+			continue;
+		assert(e->type == EXPR_TYPE_COMMAND);
+		sh->stats.commands++;
+		bool is_piped = e->next && e->next->type == EXPR_TYPE_PIPE;
+		if (is_piped) {
+			/* Not inherited by other jobs' children. */
+			if (pipe2(pipefd, O_CLOEXEC) == -1) {
+				perror("pipe");
+				exit(EXIT_FAILURE);
 			}
+			/* Reported once, the next pipes get the default. */
+			if (pipe_size > 0 &&
+			    pipe_set_size(pipefd[1], pipe_size) < 0)
+				pipe_size = 0;
+		}
 
-			if (!strcmp(e->cmd.exe, "exit") && !e->next) {
-				for (int i = 0; i < proc_wait; ++i) {
-					int status;
-					int wait_pid = wait(&status);
-					if (wait_pid == pid) {
-						last_status = WEXITSTATUS(status);
-					}
-				}
+		/* The first stage goes without `time` and `pipesize`. */
+		const struct expr *stage = e == start ? &first : e;
+		struct stage_time *time = NULL;
+		if (job->timing != NULL && stage->cmd.exe != NULL)
+			time = pipeline_time_start(job->timing, stage->cmd.exe);
 
-				if (e->cmd.arg_count == 0) {
-					last_status = 0;
-				} 
-				else {
-					last_status = atoi(e->cmd.args[0]);
-				}
+		struct stage_fds fds = {
+			.in = pipe_stdin,
+			.out = is_piped ? pipefd[1] : job->out_fd,
+			.err = STDERR_FILENO,
+		};
+		pid_t pid = 0;
+		bool is_launched = false;
+		int saved_err = -1;
+		if (stage_open_files(&fds, stage, line, e->next == NULL) != 0) {
+			job->status = 1;
+			goto stage_done;
+		}
+		/* A background job doesn't take the input of the shell. */
+		if (job->is_background && fds.in == STDIN_FILENO &&
+		    (fds.in = stage_open(&fds, "/dev/null", O_RDONLY)) < 0) {
+			job->status = 1;
+			goto stage_done;
+		}
+		saved_err = stage_redirect_stderr(&fds);
 
-				if (e == line->head) {
-					exit(last_status);
-				}
+		if (stage->cmd.exe == NULL) {
+			job->status = 0;
+		}
+
+		else if (strcmp(stage->cmd.exe, "exit") == 0) {
+			job->status = stage->cmd.arg_count == 0 ? 0 :
+				      atoi(stage->cmd.args[0]);
+			/*
+			 * Only a whole pipeline in the foreground ends the
+			 * shell. Inside a pipeline exit ends its own stage.
+			 */
+			if (e == start && !is_piped && job == sh->fg)
+				sh->is_exit = true;
+		}
+
+		else if (strcmp(stage->cmd.exe, "cd") == 0) {
+			job->status = execute_cd(stage);
+			if (sh->launcher != NULL)
+				launcher_update_cwd(sh->launcher);
+		}
 
-				return last_status;
-			} 
-			
-			else if (strcmp(e->cmd.exe, "cd") == 0) {
-				execute_cd(e);
+		else if (strcmp(stage->cmd.exe, "hash") == 0) {
+			job->status = execute_hash(stage, sh->paths);
+		}
+
+		else if (strcmp(stage->cmd.exe, "pipesize") == 0) {
+			job->status = execute_pipesize(stage, sh);
+		}
+
+		else if (strcmp(stage->cmd.exe, "parallel") == 0) {
+			job->status = execute_parallel(stage, sh);
+		}
+
+		else if (strcmp(stage->cmd.exe, "wait") == 0) {
+			/* Only a whole pipeline in the foreground waits. */
+			job->status = 0;
+			if (e == start && !is_piped && job == sh->fg)
+				job->is_waiting = true;
+		}
+
+		else {
+			builtin_f builtin = builtin_find(stage->cmd.exe);
+			stream_builtin_f stream = builtin == NULL ?
+				stream_builtin_find(&stage->cmd) : NULL;
+			if (builtin != NULL) {
+				job->status = execute_builtin(builtin, stage, fds.out,
+							      is_piped, &pid);
+			}
+			else if (stream != NULL) {
+				pid = execute_stream(stream, stage, fds.in, fds.out);
+				if (pid == -1)
+					job->status = 1;
 			}
-			
 			else {
-				pid = fork();
+				pid = spawn_command(stage, fds.in, fds.out, sh->paths,
+						    sh->launcher);
+				is_launched = sh->launcher != NULL;
 				if (pid == -1) {
-					printf("HERE 1");
-					perror("FORK");
-					exit(EXIT_FAILURE);
+					job->status = 127;
 				}
+			}
+		}
 
-				else if (pid == 0) {
-					if (pipe_stdin != 0) {
-						dup2(pipe_stdin, STDIN_FILENO);
-						close(pipe_stdin);
-						pipe_stdin = 0;
-					}
-
-					int outfd = STDOUT_FILENO;
-					if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-						outfd = open(line->out_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-					}
-					if (line->out_type == OUTPUT_TYPE_FILE_APPEND) { 
-						outfd = open(line->out_file, O_APPEND | O_RDWR | O_APPEND, 0644);
-					}
-					if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-						close(pipefd[0]);
-						outfd = pipefd[1];
-					}
-					if (outfd != STDOUT_FILENO) {
-						dup2(outfd, STDOUT_FILENO);
-						close(outfd);
-					}
-					execute_command(e);
-				}
+	stage_done:
+		stage_restore_stderr(saved_err);
+		stage_close(&fds);
+		if (pipe_stdin != STDIN_FILENO) {
+			close(pipe_stdin);
+			pipe_stdin = STDIN_FILENO;
+		}
 
-				if (pipe_stdin) {
-					close(pipe_stdin);
-				}
+		if (is_piped) {
+			pipe_stdin = pipefd[0];
+			close(pipefd[1]);
+		}
 
-				if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-					pipe_stdin = pipefd[0]; 
-					close(pipefd[1]);
-				}
+		if (pid > 0) {
+			shell_watch_child(sh, job, pid, is_launched, time);
+			if (time != NULL)
+				time->pid = pid;
+		} else if (time != NULL) {
+			stage_time_end_in_shell(time, job->status);
+		}
+		job->last_pid = pid > 0 ? pid : 0;
+		if (sh->is_exit) {
+			job->cur = NULL;
+			return;
+		}
+	}
+	job->cur = e;
+}
+
+/** Print the grouped output of a background job at once. */
+static void
+job_flush_output(struct job *job)
+{
+	char buf[1 << 16];
+	ssize_t rc;
+	fflush(stdout);
+	lseek(job->out_fd, 0, SEEK_SET);
+	while ((rc = read(job->out_fd, buf, sizeof(buf))) > 0)
+		write_all(STDOUT_FILENO, buf, rc);
+	close(job->out_fd);
+}
+
+static void
+job_run(struct shell *sh, struct job *job);
+
+static void
+job_finish(struct shell *sh, struct job *job)
+{
+	if (job == sh->fg) {
+		sh->last_status = job->status;
+		sh->fg = NULL;
+	}
+	struct job **pos = &sh->jobs;
+	while (*pos != job)
+		pos = &(*pos)->next;
+	*pos = job->next;
+	if (job->out_fd != STDOUT_FILENO)
+		job_flush_output(job);
+	free(job->timing);
+	command_line_delete(job->line);
+	bool is_background = job->is_background;
+	free(job);
+	if (is_background) {
+		sh->bg_count--;
+		if (sh->fg != NULL && sh->fg->is_waiting)
+			job_run(sh, sh->fg);
+	}
+}
 
-				proc_wait++;
+/**
+ * Move the job on while nothing of it is running: start the next
+ * pipeline or skip it by && and ||, or finish the job.
+ */
+static void
+job_run(struct shell *sh, struct job *job)
+{
+	while (job->running == 0) {
+		if (job->timing != NULL) {
+			pipeline_time_print(job->timing, stderr);
+			free(job->timing);
+			job->timing = NULL;
+		}
+		if (job->is_waiting) {
+			if (sh->bg_count > 0)
+				return;
+			job->is_waiting = false;
+		}
+		if (job->cur == NULL) {
+			job_finish(sh, job);
+			return;
+		}
+		enum expr_type type = job->cur->type;
+		if (type == EXPR_TYPE_AND || type == EXPR_TYPE_OR) {
+			job->cur = job->cur->next;
+			bool is_skip = type == EXPR_TYPE_AND ? job->status != 0 :
+				       job->status == 0;
+			if (is_skip) {
+				while (job->cur != NULL &&
+				       job->cur->type != EXPR_TYPE_AND &&
+				       job->cur->type != EXPR_TYPE_OR)
+					job->cur = job->cur->next;
+				continue;
 			}
-		} else if (e->type == EXPR_TYPE_PIPE) {
-			// printf("\tPIPE\n");
-		} else if (e->type == EXPR_TYPE_AND) {
-			// printf("\tAND\n");
-		} else if (e->type == EXPR_TYPE_OR) {
-			// printf("\tOR\n");
 		}
-		else {
-			assert(false);
+		job_start_pipeline(sh, job);
+	}
+}
+
+static void
+shell_start_line(struct shell *sh, struct command_line *line)
+{
+	struct job *job = calloc(1, sizeof(*job));
+	job->line = line;
+	job->cur = line->head;
+	job->is_background = line->is_background;
+	job->out_fd = STDOUT_FILENO;
+	job->next = sh->jobs;
+	sh->jobs = job;
+	if (job->is_background) {
+		sh->bg_count++;
+		sh->last_status = 0;
+		if (sh->is_bg_grouped) {
+			int fd = memfd_create("job-output", MFD_CLOEXEC);
+			if (fd >= 0)
+				job->out_fd = fd;
+			else
+				perror("memfd_create");
 		}
-		e = e->next;
+	} else {
+		sh->fg = job;
+	}
+	job_run(sh, job);
+}
+
+static void
+shell_child_exit(struct shell *sh, struct child *c, int status,
+		 const struct rusage *usage)
+{
+	struct job *job = c->job;
+	status = WIFEXITED(status) ? WEXITSTATUS(status) :
+		 128 + WTERMSIG(status);
+	if (c->pid == job->last_pid)
+		job->status = status;
+	if (c->time != NULL)
+		stage_time_end_child(c->time, status, usage);
+	free(c);
+	job->running--;
+	job_run(sh, job);
+}
+
+static void
+shell_reap(struct shell *sh, struct child *c)
+{
+	int status;
+	struct rusage usage;
+	if (wait4(c->pid, &status, WNOHANG, &usage) <= 0)
+		return;
+	epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, c->pidfd, NULL);
+	close(c->pidfd);
+	child_list_remove(&sh->watched, c);
+	shell_child_exit(sh, c, status, &usage);
+}
+
+/** Take the exits reported by the launcher. */
+static void
+shell_reap_launched(struct shell *sh)
+{
+	pid_t pid;
+	int status;
+	struct rusage usage;
+	while (launcher_next_exit(sh->launcher, &pid, &status, &usage) == 0) {
+		struct child *c = sh->launched;
+		while (c != NULL && c->pid != pid)
+			c = c->next;
+		if (c == NULL)
+			continue;
+		child_list_remove(&sh->launched, c);
+		shell_child_exit(sh, c, status, &usage);
 	}
+}
+
+enum {
+	/** How often the children without a pidfd are checked. */
+	SHELL_POLL_MS = 10,
+};
 
-	for (int i = 0; i < proc_wait; ++i) {
+/** Take the exits of the children without a pidfd. */
+static void
+shell_reap_unwatched(struct shell *sh)
+{
+	struct child *c = sh->unwatched;
+	while (c != NULL) {
 		int status;
-		int wait_pid = wait(&status);
-		if (wait_pid == pid) {
-			last_status = WEXITSTATUS(status);
+		struct rusage usage;
+		if (wait4(c->pid, &status, WNOHANG, &usage) <= 0) {
+			c = c->next;
+			continue;
+		}
+		child_list_remove(&sh->unwatched, c);
+		shell_child_exit(sh, c, status, &usage);
+		/* The job could start more children into the list. */
+		c = sh->unwatched;
+	}
+}
+
+static bool
+line_is_loop(const struct command_line *line)
+{
+	const char *exe = line->head->cmd.exe;
+	return line->head->type == EXPR_TYPE_COMMAND &&
+	       (strcmp(exe, "for") == 0 || strcmp(exe, "while") == 0);
+}
+
+/** The line is a single word like do or done. */
+static bool
+line_is_keyword(const struct command_line *line, const char *word)
+{
+	return line->expr_count == 1 && line->head->cmd.arg_count == 0 &&
+	       line->out_type == OUTPUT_TYPE_STDOUT && !line->is_background &&
+	       strcmp(line->head->cmd.exe, word) == 0;
+}
+
+static bool
+loop_is_while(const struct loop *l)
+{
+	return strcmp(l->head->head->cmd.exe, "while") == 0;
+}
+
+static struct loop *
+loop_new(struct command_line *head)
+{
+	struct loop *l = calloc(1, sizeof(*l));
+	l->head = head;
+	return l;
+}
+
+static void
+loop_delete(struct loop *l)
+{
+	if (l->is_body_owner) {
+		for (uint32_t i = 0; i < l->body_count; ++i)
+			command_line_delete(l->body[i]);
+		free(l->body);
+	}
+	command_line_delete(l->head);
+	free(l);
+}
+
+static void
+loop_append(struct loop *l, struct command_line *line)
+{
+	if (l->body_count == l->body_capacity) {
+		l->body_capacity = (l->body_capacity + 1) * 2;
+		l->body = realloc(l->body, l->body_capacity * sizeof(l->body[0]));
+	}
+	l->body[l->body_count++] = line;
+}
+
+/** Value of a for variable, from the innermost loop to the outer ones. */
+static const char *
+shell_var(const char *name, uint32_t len, void *ctx)
+{
+	struct shell *sh = ctx;
+	for (const struct loop *l = sh->loop; l != NULL; l = l->parent) {
+		if (loop_is_while(l) || l->word == 0)
+			continue;
+		const struct command *cmd = &l->head->head->cmd;
+		if (strlen(cmd->args[0]) == len &&
+		    memcmp(cmd->args[0], name, len) == 0)
+			return cmd->args[1 + l->word];
+	}
+	return NULL;
+}
+
+/** Make the loop the running one, if its header is right. */
+static void
+shell_push_loop(struct shell *sh, struct loop *l)
+{
+	const struct command *cmd = &l->head->head->cmd;
+	bool is_ok;
+	if (loop_is_while(l)) {
+		is_ok = cmd->arg_count > 0;
+		if (!is_ok)
+			fprintf(stderr, "while: usage: while COMMAND...\n");
+	} else {
+		is_ok = l->head->expr_count == 1 && cmd->arg_count >= 2 &&
+			strcmp(cmd->args[1], "in") == 0;
+		for (const char *c = cmd->args[0]; is_ok && *c != 0; ++c) {
+			is_ok = *c == '_' || isalpha((unsigned char)*c) ||
+				(c > cmd->args[0] && isdigit((unsigned char)*c));
 		}
+		if (!is_ok)
+			fprintf(stderr, "for: usage: for NAME in WORDS...\n");
+	}
+	if (!is_ok) {
+		sh->last_status = 1;
+		loop_delete(l);
+		return;
 	}
+	l->pc = l->body_count;
+	l->parent = sh->loop;
+	sh->loop = l;
+}
 
-	return last_status;
+static void
+shell_pop_loop(struct shell *sh)
+{
+	struct loop *l = sh->loop;
+	sh->loop = l->parent;
+	loop_delete(l);
 }
 
-int
-main(void)
+/**
+ * Start a loop nested into the running one. Its header is the body
+ * line before pc, and its own body goes up to the matching done.
+ */
+static void
+shell_push_nested_loop(struct shell *sh)
 {
-	setvbuf(stdout, NULL, _IONBF, 0);
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
-	int last_status = 0;
-	struct parser *p = parser_new();
+	struct loop *outer = sh->loop;
+	uint32_t head = outer->pc - 1;
+	/* Reading checked there is `do` after the header and a done. */
+	uint32_t end = head + 2;
+	for (int depth = 0; ; ++end) {
+		const struct command_line *line = outer->body[end];
+		if (line_is_loop(line))
+			depth++;
+		else if (line_is_keyword(line, "done") && depth-- == 0)
+			break;
+	}
+	struct loop *l = loop_new(command_line_expand(outer->body[head],
+						      shell_var, sh));
+	l->body = outer->body + head + 2;
+	l->body_count = end - head - 2;
+	outer->pc = end + 1;
+	shell_push_loop(sh, l);
+}
 
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-		parser_feed(p, buf, rc);
+/**
+ * Next line of the running loop, with the variables substituted.
+ * @retval NULL Nothing to run now, ask again: the loop has moved on.
+ */
+static struct command_line *
+shell_loop_next_line(struct shell *sh)
+{
+	struct loop *l = sh->loop;
+	if (l->pc == l->body_count) {
+		if (loop_is_while(l)) {
+			if (!l->is_checking) {
+				/* Run the condition without `while`. */
+				l->is_checking = true;
+				struct command_line *line =
+					command_line_expand(l->head, shell_var, sh);
+				struct command *cmd = &line->head->cmd;
+				cmd->exe = cmd->args[0];
+				cmd->arg_count--;
+				cmd->arg_capacity--;
+				cmd->args = cmd->arg_count > 0 ? cmd->args + 1 : NULL;
+				return line;
+			}
+			l->is_checking = false;
+			if (sh->last_status != 0) {
+				shell_pop_loop(sh);
+				sh->last_status = 0;
+				return NULL;
+			}
+		} else {
+			if (l->word + 2 == l->head->head->cmd.arg_count) {
+				shell_pop_loop(sh);
+				return NULL;
+			}
+			l->word++;
+		}
+		l->pc = 0;
+		return NULL;
+	}
+	struct command_line *line = l->body[l->pc++];
+	if (line_is_loop(line)) {
+		shell_push_nested_loop(sh);
+		return NULL;
+	}
+	if (line_is_keyword(line, "break")) {
+		shell_pop_loop(sh);
+		return NULL;
+	}
+	if (line_is_keyword(line, "continue")) {
+		l->pc = l->body_count;
+		return NULL;
+	}
+	return command_line_expand(line, shell_var, sh);
+}
+
+/**
+ * Read a line into a loop if it is a loop header or a loop is being
+ * read. The loop runs when its done is read.
+ * @retval true The line is taken.
+ */
+static bool
+shell_read_loop(struct shell *sh, struct command_line *line)
+{
+	struct loop *l = sh->reading;
+	if (l == NULL) {
+		if (!line_is_loop(line))
+			return false;
+		sh->reading = loop_new(line);
+		sh->reading->is_body_owner = true;
+		sh->reading_depth = 0;
+		sh->is_do_expected = true;
+		return true;
+	}
+	if (sh->is_do_expected) {
+		sh->is_do_expected = false;
+		if (!line_is_keyword(line, "do")) {
+			fprintf(stderr, "syntax error: do expected\n");
+			loop_delete(l);
+			sh->reading = NULL;
+			return false;
+		}
+		if (sh->reading_depth == 0) {
+			command_line_delete(line);
+			return true;
+		}
+	} else if (line_is_loop(line)) {
+		sh->reading_depth++;
+		sh->is_do_expected = true;
+	} else if (line_is_keyword(line, "done")) {
+		if (sh->reading_depth == 0) {
+			command_line_delete(line);
+			sh->reading = NULL;
+			shell_push_loop(sh, l);
+			return true;
+		}
+		sh->reading_depth--;
+	}
+	loop_append(l, line);
+	return true;
+}
+
+/**
+ * Take the next line to run: from the running loop, or from the
+ * parser.
+ * @retval NULL No lines until more input comes.
+ */
+static struct command_line *
+shell_next_line(struct shell *sh)
+{
+	while (true) {
+		if (sh->loop != NULL) {
+			struct command_line *line = shell_loop_next_line(sh);
+			if (line != NULL)
+				return line;
+			continue;
+		}
 		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
+		uint64_t start = sh->is_stats ? timing_now_ns() : 0;
+		enum parser_error err = parser_pop_next(sh->parser, &line);
+		if (sh->is_stats)
+			sh->stats.parse_ns += timing_now_ns() - start;
+		if (err == PARSER_ERR_NONE && line == NULL) {
+			if (sh->is_eof && sh->reading != NULL) {
+				fprintf(stderr, "syntax error: done expected\n");
+				loop_delete(sh->reading);
+				sh->reading = NULL;
+			}
+			return NULL;
+		}
+		sh->stats.lines++;
+		if (err != PARSER_ERR_NONE) {
+			printf("Error: %d\n", (int)err);
+			continue;
+		}
+		if (!shell_read_loop(sh, line))
+			return line;
+	}
+}
+
+/**
+ * Start the parsed lines until one has to be waited for: a foreground
+ * line, or a background one when `parallel -j` slots are all busy.
+ */
+static void
+shell_start_lines(struct shell *sh)
+{
+	while (sh->fg == NULL && !sh->is_exit) {
+		if (sh->pending == NULL) {
+			sh->pending = shell_next_line(sh);
+			if (sh->pending == NULL)
 				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
+		}
+		if (sh->pending->is_background && sh->bg_limit > 0 &&
+		    sh->bg_count >= sh->bg_limit)
+			break;
+		struct command_line *line = sh->pending;
+		sh->pending = NULL;
+		shell_start_line(sh, line);
+	}
+}
+
+enum {
+	/** The parser takes 32-bit sizes, a script is fed by parts. */
+	SCRIPT_FEED_MAX = 1 << 30,
+};
+
+static void
+shell_read_input(struct shell *sh)
+{
+	if (sh->script != NULL) {
+		size_t size = sh->script_size - sh->script_pos;
+		if (size == 0) {
+			sh->is_eof = true;
+			return;
+		}
+		if (size > SCRIPT_FEED_MAX)
+			size = SCRIPT_FEED_MAX;
+		parser_feed_static(sh->parser, sh->script + sh->script_pos, size);
+		sh->script_pos += size;
+		sh->stats.bytes += size;
+		return;
+	}
+	char buf[1024];
+	ssize_t rc = read(STDIN_FILENO, buf, sizeof(buf));
+	if (rc < 0 && errno == EINTR)
+		return;
+	if (rc <= 0) {
+		sh->is_eof = true;
+		return;
+	}
+	parser_feed(sh->parser, buf, rc);
+	sh->stats.bytes += rc;
+}
+
+/**
+ * Watch stdin only while new lines can start. Otherwise the children
+ * would get no chance to read it, and a closed pipe would keep waking
+ * epoll up.
+ */
+static void
+shell_watch_stdin(struct shell *sh, bool is_on)
+{
+	if (sh->is_stdin_watched == is_on)
+		return;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	int rc = epoll_ctl(sh->epoll_fd, is_on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			   STDIN_FILENO, &ev);
+	if (rc != 0 && errno == EPERM) {
+		sh->is_input_file = true;
+		return;
+	}
+	sh->is_stdin_watched = is_on;
+}
+
+/**
+ * Map the script of -f. The whole file is parsed in place, without
+ * reads and copies.
+ * @retval 0 Success.
+ * @retval -1 Error, it is printed.
+ */
+static int
+shell_open_script(struct shell *sh, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	sh->script_size = st.st_size;
+	sh->script = "";
+	if (sh->script_size > 0) {
+		void *data = mmap(NULL, sh->script_size, PROT_READ, MAP_PRIVATE,
+				  fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		madvise(data, sh->script_size, MADV_SEQUENTIAL);
+		sh->script = data;
+	}
+	close(fd);
+	sh->is_input_file = true;
+	return 0;
+}
+
+static void
+shell_print_stats(const struct shell *sh, uint64_t total_ns)
+{
+	const struct shell_stats *st = &sh->stats;
+	double total = total_ns / 1e9;
+	double parse = st->parse_ns / 1e9;
+	double mb = st->bytes / (1024.0 * 1024.0);
+	fprintf(stderr, "lines: %llu, commands: %llu, time: %.3f s, "
+		"%.0f commands/s\n", (unsigned long long)st->lines,
+		(unsigned long long)st->commands, total,
+		total > 0 ? st->commands / total : 0);
+	fprintf(stderr, "parser: %.2f MB in %.3f s, %.1f MB/s\n", mb, parse,
+		parse > 0 ? mb / parse : 0);
+}
+
+/**
+ * $> ./a.out [-s] [-z] [-f script]
+ *
+ * Commands are read from stdin, or from the script with -f. The script
+ * mode is for batch jobs: the file is mapped and the output of the
+ * shell itself is buffered. -s prints the command rate and the parser
+ * throughput to stderr in the end. -z starts the commands from a small
+ * launcher process forked at the start, so the cost of a launch doesn't
+ * grow with the shell's memory.
+ */
+int
+main(int argc, char **argv)
+{
+	const char *script_path = NULL;
+	bool is_stats = false;
+	bool is_launcher = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:sz")) != -1) {
+		switch (opt) {
+		case 'f':
+			script_path = optarg;
+			break;
+		case 's':
+			is_stats = true;
+			break;
+		case 'z':
+			is_launcher = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s] [-z] [-f script]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	uint64_t start = timing_now_ns();
+	/* Forked first, while the shell has nothing in its memory. */
+	struct launcher *launcher = NULL;
+	if (is_launcher && (launcher = launcher_new()) == NULL)
+		return EXIT_FAILURE;
+	struct shell sh = {
+		.epoll_fd = epoll_create1(EPOLL_CLOEXEC),
+		.is_stats = is_stats,
+		.launcher = launcher,
+	};
+	if (sh.epoll_fd < 0) {
+		perror("epoll_create1");
+		return EXIT_FAILURE;
+	}
+	if (launcher != NULL) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = launcher,
+		};
+		if (epoll_ctl(sh.epoll_fd, EPOLL_CTL_ADD,
+			      launcher_event_fd(launcher), &ev) != 0) {
+			perror("epoll_ctl");
+			return EXIT_FAILURE;
+		}
+	}
+	if (script_path != NULL) {
+		if (shell_open_script(&sh, script_path) != 0)
+			return EXIT_FAILURE;
+		static char out_buf[1 << 16];
+		static char err_buf[BUFSIZ];
+		setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+		setvbuf(stderr, err_buf, _IOFBF, sizeof(err_buf));
+	} else {
+		setvbuf(stdout, NULL, _IONBF, 0);
+	}
+	sh.parser = parser_new();
+	sh.paths = path_cache_new();
+
+	while (true) {
+		shell_start_lines(&sh);
+		bool is_reading = sh.fg == NULL && sh.pending == NULL &&
+				  !sh.is_eof;
+		/* The background jobs are finished before the exit. */
+		if ((!is_reading && sh.jobs == NULL) || sh.is_exit)
+			break;
+		if (!sh.is_input_file)
+			shell_watch_stdin(&sh, is_reading);
+		if (is_reading && sh.is_input_file) {
+			shell_read_input(&sh);
+			continue;
+		}
+		struct epoll_event events[16];
+		int timeout = sh.unwatched != NULL ? SHELL_POLL_MS : -1;
+		int count = epoll_wait(sh.epoll_fd, events, 16, timeout);
+		if (count < 0) {
+			if (errno == EINTR)
 				continue;
-			}
-			last_status = execute_command_line(line);
-			command_line_delete(line);
+			perror("epoll_wait");
+			return EXIT_FAILURE;
+		}
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.ptr == NULL)
+				shell_read_input(&sh);
+			else if (events[i].data.ptr == sh.launcher)
+				shell_reap_launched(&sh);
+			else
+				shell_reap(&sh, events[i].data.ptr);
 		}
+		if (sh.unwatched != NULL)
+			shell_reap_unwatched(&sh);
 	}
-	parser_delete(p);
-	return last_status;
+	/* Background jobs left by exit are not waited for. */
+	while (sh.jobs != NULL)
+		job_finish(&sh, sh.jobs);
+	if (sh.pending != NULL)
+		command_line_delete(sh.pending);
+	while (sh.loop != NULL)
+		shell_pop_loop(&sh);
+	if (sh.reading != NULL)
+		loop_delete(sh.reading);
+	child_list_delete(&sh.watched);
+	child_list_delete(&sh.launched);
+	child_list_delete(&sh.unwatched);
+	if (sh.launcher != NULL)
+		launcher_delete(sh.launcher);
+	if (sh.is_stats)
+		shell_print_stats(&sh, timing_now_ns() - start);
+	path_cache_delete(sh.paths);
+	parser_delete(sh.parser);
+	if (sh.script_size > 0)
+		munmap((void *)sh.script, sh.script_size);
+	close(sh.epoll_fd);
+	return sh.last_status;
 }
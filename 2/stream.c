@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include "stream.h"
+#include "parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	/** Max bytes moved by one splice() call. */
+	STREAM_CHUNK = 1 << 20,
+	STREAM_BUF_SIZE = 1 << 16,
+};
+
+/**
+ * Move @a size bytes or until EOF from @a in to @a out. splice() works
+ * only if one of them is a pipe, and the other one supports it. Else
+ * the data goes by read() and write().
+ * @retval Moved bytes, -1 on error with errno set.
+ */
+static ssize_t
+stream_move(int in, int out, size_t size)
+{
+	size_t total = 0;
+	bool is_splice = true;
+	static char buf[STREAM_BUF_SIZE];
+	while (total < size) {
+		size_t chunk = size - total < STREAM_CHUNK ? size - total :
+			       STREAM_CHUNK;
+		ssize_t rc;
+		if (is_splice) {
+			rc = splice(in, NULL, out, NULL, chunk,
+				    SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (rc < 0 && errno == EINVAL) {
+				is_splice = false;
+				continue;
+			}
+		} else {
+			if (chunk > sizeof(buf))
+				chunk = sizeof(buf);
+			rc = read(in, buf, chunk);
+			for (ssize_t done = 0; rc > 0 && done < rc;) {
+				ssize_t wrc = write(out, buf + done, rc - done);
+				if (wrc < 0 && errno != EINTR)
+					return -1;
+				if (wrc > 0)
+					done += wrc;
+			}
+		}
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		total += rc;
+	}
+	return total;
+}
+
+static bool
+stream_is_pipe(int fd)
+{
+	return fcntl(fd, F_GETPIPE_SZ) > 0;
+}
+
+/** cat [FILE]... - the files in order, - and no files mean stdin. */
+static int
+stream_cat(const struct command *cmd, int in_fd, int out_fd)
+{
+	int status = 0;
+	uint32_t count = cmd->arg_count > 0 ? cmd->arg_count : 1;
+	for (uint32_t i = 0; i < count; ++i) {
+		const char *name = cmd->arg_count > 0 ? cmd->args[i] : "-";
+		int fd = in_fd;
+		if (strcmp(name, "-") != 0) {
+			fd = open(name, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				fprintf(stderr, "cat: %s: %s\n", name,
+					strerror(errno));
+				status = 1;
+				continue;
+			}
+		}
+		if (stream_move(fd, out_fd, SIZE_MAX) < 0) {
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+		}
+		if (fd != in_fd)
+			close(fd);
+	}
+	return status;
+}
+
+/**
+ * tee with the data never copied: tee() duplicates the pages of the
+ * input pipe into an own pipe, which is spliced to a file. That is
+ * done for each file, and then the input is spliced to the stdout.
+ * The own pipe is as big as the input one, so it takes all the
+ * duplicated data at once.
+ */
+static int
+stream_tee_pipe(int in_fd, int out_fd, const int *files, int file_count)
+{
+	int tmp[2];
+	if (pipe2(tmp, O_CLOEXEC) != 0)
+		return -1;
+	int rc = -1;
+	fcntl(tmp[1], F_SETPIPE_SZ, fcntl(in_fd, F_GETPIPE_SZ));
+	while (true) {
+		ssize_t size = -1;
+		for (int i = 0; i < file_count; ++i) {
+			ssize_t teed = tee(in_fd, tmp[1], size < 0 ? STREAM_CHUNK :
+					   (size_t)size, 0);
+			if (teed < 0 && errno == EINTR) {
+				--i;
+				continue;
+			}
+			if (teed < 0 || (size >= 0 && teed != size))
+				goto out;
+			size = teed;
+			if (size == 0)
+				break;
+			if (stream_move(tmp[0], files[i], size) != size)
+				goto out;
+		}
+		if (size == 0) {
+			rc = 0;
+			break;
+		}
+		ssize_t moved = stream_move(in_fd, out_fd, size < 0 ?
+					    STREAM_CHUNK : (size_t)size);
+		if (moved < 0 || (size >= 0 && moved != size))
+			goto out;
+		if (moved == 0) {
+			rc = 0;
+			break;
+		}
+	}
+out:
+	close(tmp[0]);
+	close(tmp[1]);
+	return rc;
+}
+
+/** tee for the input which is not a pipe. */
+static int
+stream_tee_copy(int in_fd, int out_fd, const int *files, int file_count)
+{
+	static char buf[STREAM_BUF_SIZE];
+	while (true) {
+		ssize_t size = read(in_fd, buf, sizeof(buf));
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size <= 0)
+			return size;
+		for (int i = -1; i < file_count; ++i) {
+			int fd = i < 0 ? out_fd : files[i];
+			for (ssize_t done = 0; done < size;) {
+				ssize_t rc = write(fd, buf + done, size - done);
+				if (rc < 0 && errno != EINTR)
+					return -1;
+				if (rc > 0)
+					done += rc;
+			}
+		}
+	}
+}
+
+/** tee [-a] [FILE]... - stdin to stdout and the files. */
+static int
+stream_tee(const struct command *cmd, int in_fd, int out_fd)
+{
+	uint32_t first = 0;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (cmd->arg_count > 0 && strcmp(cmd->args[0], "-a") == 0) {
+		first = 1;
+		flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+	}
+	int files[cmd->arg_count + 1];
+	int file_count = 0;
+	int status = 0;
+	for (uint32_t i = first; i < cmd->arg_count; ++i) {
+		int fd = open(cmd->args[i], flags, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "tee: %s: %s\n", cmd->args[i],
+				strerror(errno));
+			status = 1;
+			continue;
+		}
+		files[file_count++] = fd;
+	}
+	int rc;
+	if (stream_is_pipe(in_fd))
+		rc = stream_tee_pipe(in_fd, out_fd, files, file_count);
+	else
+		rc = stream_tee_copy(in_fd, out_fd, files, file_count);
+	if (rc != 0) {
+		fprintf(stderr, "tee: %s\n", strerror(errno));
+		status = 1;
+	}
+	for (int i = 0; i < file_count; ++i)
+		close(files[i]);
+	return status;
+}
+
+stream_builtin_f
+stream_builtin_find(const struct command *cmd)
+{
+	bool is_cat = strcmp(cmd->exe, "cat") == 0;
+	if (!is_cat && strcmp(cmd->exe, "tee") != 0)
+		return NULL;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0)
+			continue;
+		if (is_cat || i > 0 || strcmp(arg, "-a") != 0)
+			return NULL;
+	}
+	return is_cat ? stream_cat : stream_tee;
+}
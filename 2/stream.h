@@ -0,0 +1,23 @@
+#pragma once
+
+struct command;
+
+/**
+ * A builtin which moves a stream between descriptors: cat and tee.
+ * Unlike the builtins of builtin.h it can run for long, so the shell
+ * runs it in a forked child, not in itself. The data goes by splice()
+ * and tee() when one of the sides is a pipe, and is never copied
+ * into the process then. Returns the exit status, errors are printed
+ * to stderr.
+ */
+typedef int (*stream_builtin_f)(const struct command *cmd, int in_fd,
+				int out_fd);
+
+/**
+ * Find a stream builtin for the command. cat is taken without
+ * options, tee with -a only. The others are left to the external
+ * commands.
+ * @retval NULL No such builtin or unsupported options.
+ */
+stream_builtin_f
+stream_builtin_find(const struct command *cmd);
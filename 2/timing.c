@@ -0,0 +1,176 @@
+#include "timing.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t
+timing_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+struct pipeline_time *
+pipeline_time_new(uint32_t capacity, bool is_json)
+{
+	struct pipeline_time *t = calloc(1, sizeof(*t) +
+					 capacity * sizeof(t->stages[0]));
+	t->capacity = capacity;
+	t->is_json = is_json;
+	return t;
+}
+
+struct stage_time *
+pipeline_time_start(struct pipeline_time *t, const char *name)
+{
+	if (t->count == t->capacity)
+		abort();
+	struct stage_time *s = &t->stages[t->count++];
+	s->name = name;
+	s->start_ns = timing_now_ns();
+	getrusage(RUSAGE_SELF, &s->usage);
+	return s;
+}
+
+static double
+timeval_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void
+timeval_sub(struct timeval *a, const struct timeval *b)
+{
+	a->tv_sec -= b->tv_sec;
+	a->tv_usec -= b->tv_usec;
+	if (a->tv_usec < 0) {
+		a->tv_usec += 1000000;
+		a->tv_sec--;
+	}
+}
+
+static void
+timeval_add(struct timeval *a, const struct timeval *b)
+{
+	a->tv_sec += b->tv_sec;
+	a->tv_usec += b->tv_usec;
+	if (a->tv_usec >= 1000000) {
+		a->tv_usec -= 1000000;
+		a->tv_sec++;
+	}
+}
+
+void
+stage_time_end_in_shell(struct stage_time *s, int status)
+{
+	struct rusage now;
+	getrusage(RUSAGE_SELF, &now);
+	s->end_ns = timing_now_ns();
+	s->status = status;
+	timeval_sub(&now.ru_utime, &s->usage.ru_utime);
+	timeval_sub(&now.ru_stime, &s->usage.ru_stime);
+	s->usage.ru_utime = now.ru_utime;
+	s->usage.ru_stime = now.ru_stime;
+	s->usage.ru_nvcsw = now.ru_nvcsw - s->usage.ru_nvcsw;
+	s->usage.ru_nivcsw = now.ru_nivcsw - s->usage.ru_nivcsw;
+	s->usage.ru_maxrss = 0;
+}
+
+void
+stage_time_end_child(struct stage_time *s, int status,
+		     const struct rusage *usage)
+{
+	s->end_ns = timing_now_ns();
+	s->status = status;
+	s->usage = *usage;
+}
+
+/** Sum of the stages, the wall time is from the first start to the last end. */
+static void
+pipeline_time_total(const struct pipeline_time *t, struct stage_time *total)
+{
+	*total = (struct stage_time){.name = "total"};
+	for (uint32_t i = 0; i < t->count; ++i) {
+		const struct stage_time *s = &t->stages[i];
+		if (i == 0 || s->start_ns < total->start_ns)
+			total->start_ns = s->start_ns;
+		if (s->end_ns > total->end_ns)
+			total->end_ns = s->end_ns;
+		timeval_add(&total->usage.ru_utime, &s->usage.ru_utime);
+		timeval_add(&total->usage.ru_stime, &s->usage.ru_stime);
+		total->usage.ru_nvcsw += s->usage.ru_nvcsw;
+		total->usage.ru_nivcsw += s->usage.ru_nivcsw;
+		if (s->usage.ru_maxrss > total->usage.ru_maxrss)
+			total->usage.ru_maxrss = s->usage.ru_maxrss;
+		/* A pipeline's status is the one of its last stage. */
+		total->status = s->status;
+	}
+}
+
+static void
+print_json_str(const char *str, FILE *out)
+{
+	fputc('"', out);
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void
+stage_time_print_json(const struct stage_time *s, FILE *out)
+{
+	fprintf(out, "\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+		"\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld",
+		s->status, (s->end_ns - s->start_ns) / 1e9,
+		timeval_sec(&s->usage.ru_utime),
+		timeval_sec(&s->usage.ru_stime), s->usage.ru_maxrss,
+		s->usage.ru_nvcsw, s->usage.ru_nivcsw);
+}
+
+static void
+stage_time_print_row(const struct stage_time *s, const char *num, FILE *out)
+{
+	fprintf(out, "%3s %-16.16s %6d %9.3f %9.3f %9.3f %10ld %8ld %8ld\n",
+		num, s->name, s->status, (s->end_ns - s->start_ns) / 1e9,
+		timeval_sec(&s->usage.ru_utime),
+		timeval_sec(&s->usage.ru_stime), s->usage.ru_maxrss,
+		s->usage.ru_nvcsw, s->usage.ru_nivcsw);
+}
+
+void
+pipeline_time_print(const struct pipeline_time *t, FILE *out)
+{
+	struct stage_time total;
+	pipeline_time_total(t, &total);
+	if (t->is_json) {
+		fputc('{', out);
+		stage_time_print_json(&total, out);
+		fprintf(out, ",\"stages\":[");
+		for (uint32_t i = 0; i < t->count; ++i) {
+			const struct stage_time *s = &t->stages[i];
+			fprintf(out, "%s{\"command\":", i > 0 ? "," : "");
+			print_json_str(s->name, out);
+			fprintf(out, ",\"pid\":%d,", (int)s->pid);
+			stage_time_print_json(s, out);
+			fputc('}', out);
+		}
+		fprintf(out, "]}\n");
+		return;
+	}
+	fprintf(out, "%3s %-16s %6s %9s %9s %9s %10s %8s %8s\n", "#", "command",
+		"status", "real", "user", "sys", "maxrss_kb", "vcsw", "ivcsw");
+	for (uint32_t i = 0; i < t->count; ++i) {
+		char num[16];
+		snprintf(num, sizeof(num), "%u", i + 1);
+		stage_time_print_row(&t->stages[i], num, out);
+	}
+	stage_time_print_row(&total, "", out);
+}
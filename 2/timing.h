@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/** Resources used by one stage of a pipeline run under `time`. */
+struct stage_time {
+	/** Command name, points into the command line. */
+	const char *name;
+	/** 0 if the stage ran inside the shell. */
+	pid_t pid;
+	int status;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	/**
+	 * Usage of the child from wait4(). For an in-shell stage it is
+	 * the shell's own usage while the stage ran, without max RSS.
+	 */
+	struct rusage usage;
+};
+
+/**
+ * Timing of a pipeline: the `time` prefix. A breakdown per stage is
+ * printed with the totals when all the stages have ended.
+ */
+struct pipeline_time {
+	/** Print one JSON object instead of a table. */
+	bool is_json;
+	uint32_t count;
+	uint32_t capacity;
+	struct stage_time stages[];
+};
+
+uint64_t
+timing_now_ns(void);
+
+/** A pipeline timing for at most @a capacity stages. Freed by free(). */
+struct pipeline_time *
+pipeline_time_new(uint32_t capacity, bool is_json);
+
+/**
+ * Add a stage starting now. Until it ends, its usage holds the
+ * shell's usage at the start.
+ */
+struct stage_time *
+pipeline_time_start(struct pipeline_time *t, const char *name);
+
+/** End a stage which ran inside the shell. */
+void
+stage_time_end_in_shell(struct stage_time *s, int status);
+
+/** End a stage by its reaped process. */
+void
+stage_time_end_child(struct stage_time *s, int status,
+		     const struct rusage *usage);
+
+void
+pipeline_time_print(const struct pipeline_time *t, FILE *out);
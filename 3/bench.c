@@ -0,0 +1,140 @@
+#include "userfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Stress benchmark of the file name lookups. For file counts from 1000
+ * up to the max by 10 times the files are created, opened by name in
+ * a scattered order, deleted while opened and created back, and then
+ * deleted. The time per operation of each phase has to stay the same
+ * while the file count grows.
+ *
+ * $> make bench
+ * $> ./bench [-n max_count]
+ */
+
+enum bench_phase {
+	PHASE_CREATE,
+	PHASE_OPEN,
+	PHASE_MISS,
+	PHASE_GHOST,
+	PHASE_DELETE,
+	PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	"create", "open", "miss", "ghost", "delete",
+};
+
+enum {
+	/** Prime, so the steps by it visit all the files in a mixed order. */
+	BENCH_STEP = 1000003,
+};
+
+static long long
+bench_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static const char *
+bench_name(char *buf, const char *prefix, int i)
+{
+	sprintf(buf, "%s%d", prefix, i);
+	return buf;
+}
+
+/**
+ * Run all the phases on @a count files. Times go to @a times.
+ * @retval 0 Success.
+ * @retval -1 An operation failed.
+ */
+static int
+bench_run(int count, long long *times)
+{
+	char name[32];
+	long long start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		int fd = ufs_open(bench_name(name, "file", i), UFS_CREATE);
+		if (fd == -1 || ufs_close(fd) != 0)
+			return -1;
+	}
+	times[PHASE_CREATE] = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (long long i = 0; i < count; ++i) {
+		int fd = ufs_open(bench_name(name, "file", i * BENCH_STEP % count),
+				  0);
+		if (fd == -1 || ufs_close(fd) != 0)
+			return -1;
+	}
+	times[PHASE_OPEN] = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		if (ufs_open(bench_name(name, "none", i), 0) != -1 ||
+		    ufs_errno() != UFS_ERR_NO_FILE)
+			return -1;
+	}
+	times[PHASE_MISS] = bench_now_ns() - start;
+
+	/* A deleted file stays alive for its descriptor. */
+	start = bench_now_ns();
+	for (long long i = 0; i < count; ++i) {
+		bench_name(name, "file", i * BENCH_STEP % count);
+		int fd = ufs_open(name, 0);
+		if (fd == -1 || ufs_delete(name) != 0 || ufs_open(name, 0) != -1)
+			return -1;
+		int new_fd = ufs_open(name, UFS_CREATE);
+		if (new_fd == -1 || ufs_close(fd) != 0 || ufs_close(new_fd) != 0)
+			return -1;
+	}
+	times[PHASE_GHOST] = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		if (ufs_delete(bench_name(name, "file", i)) != 0)
+			return -1;
+	}
+	times[PHASE_DELETE] = bench_now_ns() - start;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_count = 1000000;
+	int c;
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		if (c != 'n' || (max_count = atoi(optarg)) < 1000) {
+			printf("Usage: %s [-n max_count >= 1000]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	int rc = 0;
+	printf("%-10s", "files");
+	for (int p = 0; p < PHASE_COUNT; ++p)
+		printf(" %10s", phase_names[p]);
+	printf("   ns per operation\n");
+	for (int count = 1000; count <= max_count && rc == 0; count *= 10) {
+		long long times[PHASE_COUNT];
+		rc = bench_run(count, times);
+		if (rc != 0) {
+			printf("Failed on %d files, error %d\n", count, ufs_errno());
+			break;
+		}
+		printf("%-10d", count);
+		for (int p = 0; p < PHASE_COUNT; ++p)
+			printf(" %10.1f", (double)times[p] / count);
+		printf("\n");
+		if (count > max_count / 10)
+			break;
+	}
+	ufs_destroy();
+	return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
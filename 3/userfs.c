@@ -1,6 +1,7 @@
 #include "userfs.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -9,6 +10,10 @@
 enum {
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Bucket count of a new file table. */
+	FILE_TABLE_MIN_SIZE = 16,
+	/** Old buckets moved to the new ones per table operation. */
+	FILE_TABLE_MOVE_STEP = 8,
 };
 
 /** Global error code. Set from any function on any error. */
@@ -43,13 +48,36 @@ struct file {
 	struct file *next;
 	struct file *prev;
 	int is_del;
-
-	/* PUT HERE OTHER MEMBERS */
+	/** Hash of the name, not computed again on lookups and resizes. */
+	uint32_t hash;
+	/** Next file in the bucket of the file table. */
+	struct file *hash_next;
 };
 
 /** List of all files. */
 static struct file *file_list = NULL;
 
+/**
+ * Not deleted files by name. A chained hash table, which grows
+ * incrementally: a new bucket array twice bigger is made, and each
+ * operation moves a few old buckets into it. So no single open
+ * rehashes all the files. A deleted file leaves the table at once,
+ * even if it is still opened. Then the name can be created again.
+ */
+struct file_table {
+	/** The count is a power of 2. */
+	struct file **buckets;
+	uint32_t mask;
+	/** Buckets being moved during a resize, NULL otherwise. */
+	struct file **old_buckets;
+	uint32_t old_mask;
+	/** Old buckets before it are moved already. */
+	uint32_t move_pos;
+	uint32_t count;
+};
+
+static struct file_table file_table;
+
 struct filedesc {
 	struct file *file;
 	int pos;
@@ -98,20 +126,131 @@ int get_free_fd_adress() {
 	return -1;
 }
 
+/** FNV-1a. */
+static uint32_t
+file_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+	for (; *name != 0; ++name)
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	return hash;
+}
+
+/** Move a few old buckets to the new array, if a resize goes. */
+static void
+file_table_step(struct file_table *t)
+{
+	if (t->old_buckets == NULL)
+		return;
+	for (int i = 0; i < FILE_TABLE_MOVE_STEP && t->move_pos <= t->old_mask;
+	     ++i, ++t->move_pos) {
+		struct file *file = t->old_buckets[t->move_pos];
+		while (file != NULL) {
+			struct file *next = file->hash_next;
+			struct file **bucket = &t->buckets[file->hash & t->mask];
+			file->hash_next = *bucket;
+			*bucket = file;
+			file = next;
+		}
+	}
+	if (t->move_pos > t->old_mask) {
+		free(t->old_buckets);
+		t->old_buckets = NULL;
+	}
+}
+
+/** The bucket the file with such a hash is in now. */
+static struct file **
+file_table_bucket(struct file_table *t, uint32_t hash)
+{
+	if (t->old_buckets != NULL && (hash & t->old_mask) >= t->move_pos)
+		return &t->old_buckets[hash & t->old_mask];
+	return &t->buckets[hash & t->mask];
+}
+
+/**
+ * Make room for one more file. The table grows when it has as many
+ * files as buckets.
+ * @retval 0 Success.
+ * @retval -1 No memory for the first buckets.
+ */
+static int
+file_table_reserve(struct file_table *t)
+{
+	if (t->buckets == NULL) {
+		t->buckets = calloc(FILE_TABLE_MIN_SIZE, sizeof(*t->buckets));
+		if (t->buckets == NULL)
+			return -1;
+		t->mask = FILE_TABLE_MIN_SIZE - 1;
+		return 0;
+	}
+	if (t->count <= t->mask || t->mask == UINT32_MAX / 2)
+		return 0;
+	/* The previous resize is short of steps, finish it first. */
+	while (t->old_buckets != NULL)
+		file_table_step(t);
+	uint32_t size = (t->mask + 1) * 2;
+	struct file **buckets = calloc(size, sizeof(*buckets));
+	/* Works as it is, only with longer chains. */
+	if (buckets == NULL)
+		return 0;
+	t->old_buckets = t->buckets;
+	t->old_mask = t->mask;
+	t->move_pos = 0;
+	t->buckets = buckets;
+	t->mask = size - 1;
+	return 0;
+}
+
+static void
+file_table_insert(struct file_table *t, struct file *file)
+{
+	file_table_step(t);
+	struct file **bucket = file_table_bucket(t, file->hash);
+	file->hash_next = *bucket;
+	*bucket = file;
+	t->count++;
+}
+
+static void
+file_table_remove(struct file_table *t, struct file *file)
+{
+	file_table_step(t);
+	struct file **pos = file_table_bucket(t, file->hash);
+	while (*pos != file)
+		pos = &(*pos)->hash_next;
+	*pos = file->hash_next;
+	file->hash_next = NULL;
+	t->count--;
+}
+
+static void
+file_table_destroy(struct file_table *t)
+{
+	free(t->buckets);
+	free(t->old_buckets);
+	memset(t, 0, sizeof(*t));
+}
+
 struct file *file_find(const char *filename) {
-	struct file *file = file_list;
+	if (file_table.buckets == NULL)
+		return NULL;
+	uint32_t hash = file_name_hash(filename);
+	file_table_step(&file_table);
+	struct file *file = *file_table_bucket(&file_table, hash);
 	while (file != NULL) {
-		if (!strcmp(file->name, filename)) {
+		if (file->hash == hash && !strcmp(file->name, filename)) {
 			return file;
 		}
-		file = file->prev;
+		file = file->hash_next;
 	}
 	return NULL;
 }
 
 struct file *file_create(const char *filename) {
 	struct file *file = malloc(sizeof(struct file));
-	if (file == NULL) {
+	if (file == NULL || file_table_reserve(&file_table) != 0) {
+		free(file);
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return NULL;
 	}
@@ -123,6 +262,8 @@ struct file *file_create(const char *filename) {
 	file->prev = NULL;
 	file->refs = 0;
 	file->is_del = 0;
+	file->hash = file_name_hash(filename);
+	file_table_insert(&file_table, file);
 
 	if (file_list == NULL) {
 		file_list = file;
@@ -140,21 +281,24 @@ struct file *file_create(const char *filename) {
 }
 
 int ufs_open(const char *filename, int flags) {
+    /* Deleted files are not in the table. */
+    struct file *file = file_find(filename);
+    if (file == NULL && !(flags & UFS_CREATE)) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    /* Taken after the lookup, a failed open doesn't hold a slot. */
     int fd = get_free_fd_adress();
     if (fd == -1) {
         ufs_error_code = UFS_ERR_INTERNAL;
         return -1;
     }
 
-    struct file *file = file_find(filename);
-    if (file == NULL || file->is_del) {
-        if (flags & UFS_CREATE) {
-            file = file_create(filename);
-            if (file == NULL) {
-                return -1;
-            }
-        } else {
-            ufs_error_code = UFS_ERR_NO_FILE;
+    if (file == NULL) {
+        file = file_create(filename);
+        if (file == NULL) {
+            file_descriptor_count--;
             return -1;
         }
     }
@@ -370,6 +514,7 @@ int ufs_delete(const char *filename) {
 	}
 
 	file->is_del = 1;
+	file_table_remove(&file_table, file);
 
 	file_delete(file);
 	return 0;
@@ -389,6 +534,7 @@ void ufs_destroy(void) {
 		}
 	}
 	free(file_descriptors);
+	file_table_destroy(&file_table);
 }
 #ifdef NEED_RESIZE
 